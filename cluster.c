@@ -0,0 +1,370 @@
+#include <stdint.h>
+
+// STREAMED SPHERE CLUSTERS
+//
+// Scenes too large for memory keep their spheres in a cluster file instead of
+// the JSON scene. The file splits a box in front of the camera into a uniform
+// grid, and the spheres of each grid cell are stored together in one page
+// sized cluster. Every sphere lies entirely inside its cell, so walking the
+// cells a ray passes through in order finds the nearest hit in the first cell
+// that has one.
+//
+// Layout of a cluster file, every part starting on a page boundary:
+//   header page     ClusterHeader
+//   count table     one uint16_t sphere count per cell
+//   clusters        CLUSTER_SIZE bytes per cell, in x, then y, then z order
+//
+// The file is mapped read only and never read in full. Clusters are paged in
+// as rays reach them, the ones just ahead of a ray are prefetched, and once
+// more than the cache limit are resident the oldest are dropped again.
+
+#define CLUSTER_SIZE 4096
+#define CLUSTER_CAPACITY (CLUSTER_SIZE / sizeof(ClusterSphere))
+// the kernel maps file pages in aligned windows around a fault, so residency
+// is tracked and dropped a whole window at a time
+#define CACHE_WINDOW 65536
+// cells ahead of the current one that are prefetched along a ray
+#define PREFETCH_DEPTH 8
+
+typedef struct {
+  char magic[8];
+  int32_t grid[3];
+  int32_t pad;
+  double min[3];
+  double max[3];
+  int64_t sphere_count;
+} ClusterHeader;
+
+// SPHERE RECORD STORED IN A CLUSTER
+typedef struct {
+  float position[3];
+  float radius;
+  float diffuse[3];
+  float specular[3];
+  float reflectivity;
+  float pad;
+} ClusterSphere;
+
+// OPEN CLUSTER FILE, SHARED BY ALL OBJECTS THAT NAME IT
+typedef struct ClusterFile {
+  char* filename;
+  ClusterHeader header;
+  int64_t cell_count;
+  uint16_t* counts;
+  const char* clusters;
+  size_t map_size;
+  const char* map;
+  // resident windows in the order they were paged in
+  int64_t* ring;
+  int64_t ring_size;
+  int64_t ring_pos;
+  unsigned char* resident;
+  // cells along the current ray
+  int64_t* path;
+  struct ClusterFile* next;
+} ClusterFile;
+
+ClusterFile* cluster_files = NULL;
+// most bytes of clusters kept resident at once, set from --cache-mb
+int64_t cluster_cache = 256 * 1024 * 1024;
+
+static inline size_t page_round(size_t size) {
+  return (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_SIZE;
+}
+
+// open_clusters() maps a cluster file and reads its header and count table.
+// Files are cached by name like meshes.
+ClusterFile* open_clusters(char* filename) {
+  for (ClusterFile* f = cluster_files; f != NULL; f = f->next) {
+    if (strcmp(f->filename, filename) == 0) return f;
+  }
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Could not open cluster file \"%s\"\n", filename);
+    exit(1);
+  }
+  ClusterFile* f = malloc(sizeof(ClusterFile));
+  if (read(fd, &f->header, sizeof(ClusterHeader)) != sizeof(ClusterHeader) ||
+      memcmp(f->header.magic, "RTCLUST1", 8) != 0) {
+    fprintf(stderr, "Error: \"%s\" is not a cluster file.\n", filename);
+    exit(1);
+  }
+  // the grid sizes the tables and the DDA divides by it, so it has to make
+  // sense before anything else is read
+  for (int k = 0; k < 3; k++) {
+    if (f->header.grid[k] <= 0 || !(f->header.max[k] > f->header.min[k])) {
+      fprintf(stderr, "Error: Cluster file \"%s\" has a bad grid.\n", filename);
+      exit(1);
+    }
+  }
+  f->cell_count = (int64_t) f->header.grid[0] * f->header.grid[1] * f->header.grid[2];
+  size_t table = page_round(f->cell_count * sizeof(uint16_t));
+  f->map_size = CLUSTER_SIZE + table + f->cell_count * CLUSTER_SIZE;
+  struct stat st;
+  fstat(fd, &st);
+  if ((size_t) st.st_size < f->map_size) {
+    fprintf(stderr, "Error: Cluster file \"%s\" is truncated.\n", filename);
+    exit(1);
+  }
+  f->map = mmap(NULL, f->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (f->map == MAP_FAILED) {
+    fprintf(stderr, "Error: Could not map cluster file \"%s\"\n", filename);
+    exit(1);
+  }
+  close(fd);
+  // the kernel should only read what is asked for
+  madvise((void*) f->map, f->map_size, MADV_RANDOM);
+
+  // the count table is the only part kept in memory for the whole render
+  f->counts = malloc(f->cell_count * sizeof(uint16_t));
+  memcpy(f->counts, f->map + CLUSTER_SIZE, f->cell_count * sizeof(uint16_t));
+  madvise((void*) (f->map + CLUSTER_SIZE), table, MADV_DONTNEED);
+  // a cluster is read up to its count, which must stay inside its page
+  for (int64_t i = 0; i < f->cell_count; i++) {
+    if (f->counts[i] > CLUSTER_CAPACITY) {
+      fprintf(stderr, "Error: Cluster %lld in \"%s\" holds %d spheres, at most %d fit.\n",
+              (long long) i, filename, f->counts[i], (int) CLUSTER_CAPACITY);
+      exit(1);
+    }
+  }
+  f->clusters = f->map + CLUSTER_SIZE + table;
+
+  f->ring_size = cluster_cache / CACHE_WINDOW > 0 ? cluster_cache / CACHE_WINDOW : 1;
+  f->ring = malloc(f->ring_size * sizeof(int64_t));
+  f->ring_pos = 0;
+  for (int64_t i = 0; i < f->ring_size; i++) {
+    f->ring[i] = -1;
+  }
+  f->resident = calloc(f->map_size / CACHE_WINDOW + 2, 1);
+  f->path = malloc((f->header.grid[0] + f->header.grid[1] + f->header.grid[2] + 3) * sizeof(int64_t));
+  f->filename = strdup(filename);
+
+  printf("Opened cluster file \"%s\" with %lld spheres in %lld clusters.\n", filename,
+         (long long) f->header.sphere_count, (long long) f->cell_count);
+  f->next = cluster_files;
+  cluster_files = f;
+  return f;
+}
+
+// window() gives the cache window a cluster lies in, counted from the window
+// holding the start of the mapping
+static inline int64_t window(ClusterFile* f, int64_t cell) {
+  return (int64_t) ((uintptr_t) (f->clusters + cell * CLUSTER_SIZE) / CACHE_WINDOW -
+                    (uintptr_t) f->map / CACHE_WINDOW);
+}
+
+// touch_cluster() records that a cluster is about to be read. If that makes
+// too many windows resident, the oldest one is handed back to the kernel.
+static inline void touch_cluster(ClusterFile* f, int64_t cell) {
+  int64_t w = window(f, cell);
+  if (f->resident[w]) return;
+  int64_t old = f->ring[f->ring_pos];
+  if (old >= 0) {
+    uintptr_t start = ((uintptr_t) f->map / CACHE_WINDOW + old) * CACHE_WINDOW;
+    uintptr_t end = start + CACHE_WINDOW;
+    if (start < (uintptr_t) f->map) start = (uintptr_t) f->map;
+    if (end > (uintptr_t) f->map + f->map_size) end = (uintptr_t) f->map + f->map_size;
+    madvise((void*) start, end - start, MADV_DONTNEED);
+    f->resident[old] = 0;
+  }
+  f->ring[f->ring_pos] = w;
+  f->ring_pos = (f->ring_pos + 1) % f->ring_size;
+  f->resident[w] = 1;
+}
+
+static inline void prefetch_cluster(ClusterFile* f, int64_t cell) {
+  if (f->resident[window(f, cell)] || f->counts[cell] == 0) return;
+  madvise((void*) (f->clusters + cell * CLUSTER_SIZE), CLUSTER_SIZE, MADV_WILLNEED);
+}
+
+// cluster_path() walks the grid cells a ray passes through, front to back,
+// and stores them in f->path. Returns the number of cells.
+int cluster_path(ClusterFile* f, double* Ro, double* Rd) {
+  double* min = f->header.min;
+  double* max = f->header.max;
+  int* grid = f->header.grid;
+  double tmin = 0;
+  double tmax = INFINITY;
+  for (int k = 0; k < 3; k++) {
+    double inv = 1.0 / Rd[k];
+    double t0 = (min[k] - Ro[k]) * inv;
+    double t1 = (max[k] - Ro[k]) * inv;
+    if (t0 > t1) {
+      double swap = t0;
+      t0 = t1;
+      t1 = swap;
+    }
+    if (t0 > tmin) tmin = t0;
+    if (t1 < tmax) tmax = t1;
+  }
+  if (tmin > tmax) return 0;
+
+  // 3D DDA from the point the ray enters the grid
+  int cell[3];
+  int step[3];
+  double next[3];
+  double delta[3];
+  for (int k = 0; k < 3; k++) {
+    double size = (max[k] - min[k]) / grid[k];
+    double p = Ro[k] + Rd[k] * tmin;
+    cell[k] = (int) ((p - min[k]) / size);
+    if (cell[k] < 0) cell[k] = 0;
+    if (cell[k] >= grid[k]) cell[k] = grid[k] - 1;
+    if (Rd[k] > 0) {
+      step[k] = 1;
+      next[k] = (min[k] + (cell[k] + 1) * size - Ro[k]) / Rd[k];
+      delta[k] = size / Rd[k];
+    } else if (Rd[k] < 0) {
+      step[k] = -1;
+      next[k] = (min[k] + cell[k] * size - Ro[k]) / Rd[k];
+      delta[k] = -size / Rd[k];
+    } else {
+      step[k] = 0;
+      next[k] = INFINITY;
+      delta[k] = INFINITY;
+    }
+  }
+  int n = 0;
+  while (1) {
+    f->path[n++] = ((int64_t) cell[2] * grid[1] + cell[1]) * grid[0] + cell[0];
+    int k = 0;
+    if (next[1] < next[k]) k = 1;
+    if (next[2] < next[k]) k = 2;
+    if (next[k] > tmax) break;
+    cell[k] += step[k];
+    if (cell[k] < 0 || cell[k] >= grid[k]) break;
+    next[k] += delta[k];
+  }
+  return n;
+}
+
+// clusters_intersection() finds the nearest streamed sphere along a ray and
+// copies it into hit as a sphere object so it can be shaded like any other.
+// Hits closer than a small epsilon are ignored, so a ray leaving a streamed
+// sphere does not hit that sphere again.
+double clusters_intersection(double* Ro, double* Rd, ClusterFile* f, Object* hit) {
+  int n = cluster_path(f, Ro, Rd);
+  for (int i = 0; i < n && i < PREFETCH_DEPTH; i++) {
+    prefetch_cluster(f, f->path[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    if (i + PREFETCH_DEPTH < n) {
+      prefetch_cluster(f, f->path[i + PREFETCH_DEPTH]);
+    }
+    int64_t cell = f->path[i];
+    int count = f->counts[cell];
+    if (count == 0) continue;
+    touch_cluster(f, cell);
+    const ClusterSphere* spheres = (const ClusterSphere*) (f->clusters + cell * CLUSTER_SIZE);
+    double best_t = INFINITY;
+    int best = -1;
+    for (int j = 0; j < count; j++) {
+      double oc[3] = {
+        Ro[0] - spheres[j].position[0],
+        Ro[1] - spheres[j].position[1],
+        Ro[2] - spheres[j].position[2]
+      };
+      double a = Rd[0]*Rd[0] + Rd[1]*Rd[1] + Rd[2]*Rd[2];
+      double b = 2 * (oc[0]*Rd[0] + oc[1]*Rd[1] + oc[2]*Rd[2]);
+      double c = oc[0]*oc[0] + oc[1]*oc[1] + oc[2]*oc[2] - (double) spheres[j].radius * spheres[j].radius;
+      double det = b*b - 4*a*c;
+      if (det < 0) continue;
+      det = sqrt(det);
+      double t = (-b - det) / (2*a);
+      if (t < 1e-6) t = (-b + det) / (2*a);
+      if (t >= 1e-6 && t < best_t) {
+        best_t = t;
+        best = j;
+      }
+    }
+    // the sphere is inside this cell, nothing in a later cell can be closer
+    if (best >= 0) {
+      hit->kind = 1;
+      for (int k = 0; k < 3; k++) {
+        hit->sphere.position[k] = spheres[best].position[k];
+        hit->sphere.diffuse[k] = spheres[best].diffuse[k];
+        hit->sphere.specular[k] = spheres[best].specular[k];
+      }
+      hit->sphere.radius = spheres[best].radius;
+      hit->sphere.reflectivity = spheres[best].reflectivity;
+      hit->sphere.refractivity = 0;
+      hit->sphere.ior = 0;
+      return best_t;
+    }
+  }
+  return -1;
+}
+
+// generate_clusters() writes a cluster file of count random spheres filling
+// a box in front of the camera. Cells are written one at a time, so the file
+// can be far larger than memory.
+void generate_clusters(int64_t count, char* filename) {
+  // aim for about half full clusters so none overflow
+  int64_t cells = count / (CLUSTER_CAPACITY / 2) + 1;
+  int g = (int) ceil(cbrt((double) cells));
+  ClusterHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "RTCLUST1", 8);
+  header.grid[0] = g;
+  header.grid[1] = g;
+  header.grid[2] = g;
+  double min[3] = {-10, -10, 10};
+  double max[3] = {10, 10, 30};
+  for (int k = 0; k < 3; k++) {
+    header.min[k] = min[k];
+    header.max[k] = max[k];
+  }
+  header.sphere_count = count;
+  int64_t cell_count = (int64_t) g * g * g;
+
+  FILE* out = fopen(filename, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Error: Could not open cluster file \"%s\"\n", filename);
+    exit(1);
+  }
+  char* page = calloc(CLUSTER_SIZE, 1);
+  memcpy(page, &header, sizeof(header));
+  fwrite(page, CLUSTER_SIZE, 1, out);
+
+  // spread the spheres evenly, the first cells take the remainder
+  int64_t base = count / cell_count;
+  int64_t extra = count % cell_count;
+  for (int64_t i = 0; i < cell_count; i++) {
+    uint16_t n = base + (i < extra);
+    fwrite(&n, sizeof(n), 1, out);
+  }
+  size_t table = cell_count * sizeof(uint16_t);
+  fwrite(page, page_round(table) - table, 1, out);
+
+  double size[3];
+  for (int k = 0; k < 3; k++) {
+    size[k] = (max[k] - min[k]) / g;
+  }
+  srand(430);
+  for (int64_t i = 0; i < cell_count; i++) {
+    int64_t n = base + (i < extra);
+    int cell[3] = {i % g, (i / g) % g, i / ((int64_t) g * g)};
+    memset(page, 0, CLUSTER_SIZE);
+    ClusterSphere* spheres = (ClusterSphere*) page;
+    for (int j = 0; j < n; j++) {
+      double r = size[0] * (0.02 + 0.08 * rand() / RAND_MAX);
+      for (int k = 0; k < 3; k++) {
+        // keep the whole sphere inside its cell
+        double lo = min[k] + cell[k] * size[k] + r;
+        spheres[j].position[k] = lo + (size[k] - 2*r) * rand() / RAND_MAX;
+        spheres[j].diffuse[k] = (double) rand() / RAND_MAX;
+        spheres[j].specular[k] = 1;
+      }
+      spheres[j].radius = r;
+      spheres[j].reflectivity = rand() % 4 == 0 ? 0.5 : 0;
+    }
+    if (fwrite(page, CLUSTER_SIZE, 1, out) != 1) {
+      fprintf(stderr, "Error: Could not write cluster file \"%s\"\n", filename);
+      exit(1);
+    }
+  }
+  fclose(out);
+  free(page);
+  printf("Wrote %lld spheres in %lld clusters to \"%s\".\n", (long long) count,
+         (long long) cell_count, filename);
+}
@@ -0,0 +1,552 @@
+// COMPRESSED IMAGE OUTPUT
+//
+// PNG and QOI writers with no outside library. The framebuffer is cut into
+// bands of rows, and worker threads encode each band as soon as the renderer
+// has finished its rows, so encoding runs alongside the rest of the render.
+//
+// PNG bands are deflated on their own and written as separate IDAT chunks.
+// Every band but the last ends with an empty stored block, which pads it to a
+// whole byte, so the bands join into one valid zlib stream. QOI bands start
+// from the encoder state a serial encoder would have at that pixel, rebuilt
+// from the pixels before the band, so they join into one valid QOI stream.
+
+#include <strings.h>
+
+#define FORMAT_PPM 0
+#define FORMAT_PNG 1
+#define FORMAT_QOI 2
+
+// deflate window and match limits
+#define WINDOW_SIZE 32768
+#define HASH_SIZE 32768
+#define MAX_MATCH 258
+#define MAX_CHAIN 32
+
+// ENCODED BAND OF ROWS
+typedef struct {
+  int first_row;
+  int rows;
+  unsigned char* data;
+  size_t size;
+  size_t capacity;
+  // PNG only, adler32 and length of the band's uncompressed bytes
+  unsigned long adler;
+  size_t raw_size;
+  // bits not yet written out by the deflate coder
+  unsigned long bits;
+  int bit_count;
+} Band;
+
+// ENCODER SHARED BY THE RENDERER AND THE WORKER THREADS
+typedef struct {
+  int format;
+  Pixel* image;
+  int width;
+  int height;
+  Band* bands;
+  int band_count;
+  // next band for a worker to take, and rows the renderer has finished
+  int next_band;
+  int rows_done;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  pthread_t* threads;
+  int thread_count;
+} Encoder;
+
+// output_format() picks the format from the file extension
+int output_format(char* filename) {
+  char* dot = strrchr(filename, '.');
+  if (dot != NULL && strcasecmp(dot, ".png") == 0) return FORMAT_PNG;
+  if (dot != NULL && strcasecmp(dot, ".qoi") == 0) return FORMAT_QOI;
+  return FORMAT_PPM;
+}
+
+static inline void put_byte(Band* band, unsigned char b) {
+  if (band->size == band->capacity) {
+    band->capacity = band->capacity * 2 + 1024;
+    band->data = realloc(band->data, band->capacity);
+  }
+  band->data[band->size++] = b;
+}
+
+static inline void put_be32(Band* band, unsigned long v) {
+  put_byte(band, v >> 24);
+  put_byte(band, v >> 16);
+  put_byte(band, v >> 8);
+  put_byte(band, v);
+}
+
+//////////////////////////////////////////////////////////
+// DEFLATE                                              //
+//////////////////////////////////////////////////////////
+
+// put_bits() adds count bits of value to the stream, least significant first
+static inline void put_bits(Band* band, unsigned long value, int count) {
+  band->bits |= value << band->bit_count;
+  band->bit_count += count;
+  while (band->bit_count >= 8) {
+    put_byte(band, band->bits & 0xff);
+    band->bits >>= 8;
+    band->bit_count -= 8;
+  }
+}
+
+// put_code() adds a Huffman code, which deflate stores most significant first
+static inline void put_code(Band* band, unsigned int code, int length) {
+  unsigned int reversed = 0;
+  for (int i = 0; i < length; i++) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  put_bits(band, reversed, length);
+}
+
+// put_literal() writes a literal or length symbol with the fixed code
+static inline void put_literal(Band* band, int symbol) {
+  if (symbol < 144) put_code(band, 0x30 + symbol, 8);
+  else if (symbol < 256) put_code(band, 0x190 + symbol - 144, 9);
+  else if (symbol < 280) put_code(band, symbol - 256, 7);
+  else put_code(band, 0xc0 + symbol - 280, 8);
+}
+
+static const int length_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const int length_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const int distance_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const int distance_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static inline void put_match(Band* band, int length, int distance) {
+  int l = 28;
+  while (length_base[l] > length) l--;
+  put_literal(band, 257 + l);
+  put_bits(band, length - length_base[l], length_extra[l]);
+  int d = 29;
+  while (distance_base[d] > distance) d--;
+  put_code(band, d, 5);
+  put_bits(band, distance - distance_base[d], distance_extra[d]);
+}
+
+// deflate_band() compresses raw into one fixed Huffman block, matching
+// repeats with a hash chain over the last WINDOW_SIZE bytes. A band that is
+// not the last ends with an empty stored block to bring it to a byte
+// boundary, so the next band can follow it directly.
+void deflate_band(Band* band, unsigned char* raw, size_t size, int last) {
+  int* head = malloc(HASH_SIZE * sizeof(int));
+  int* prev = malloc(WINDOW_SIZE * sizeof(int));
+  for (int i = 0; i < HASH_SIZE; i++) {
+    head[i] = -1;
+  }
+  put_bits(band, last, 1);
+  put_bits(band, 1, 2);
+  size_t i = 0;
+  while (i < size) {
+    int best_length = 0;
+    int best_distance = 0;
+    if (i + 2 < size) {
+      unsigned int h = ((raw[i] << 10) ^ (raw[i+1] << 5) ^ raw[i+2]) & (HASH_SIZE - 1);
+      int candidate = head[h];
+      int chain = 0;
+      while (candidate >= 0 && i - candidate <= WINDOW_SIZE - 1 && chain < MAX_CHAIN) {
+        int length = 0;
+        while (length < MAX_MATCH && i + length < size && raw[candidate + length] == raw[i + length]) {
+          length++;
+        }
+        if (length > best_length) {
+          best_length = length;
+          best_distance = i - candidate;
+          if (length == MAX_MATCH) break;
+        }
+        candidate = prev[candidate % WINDOW_SIZE];
+        chain++;
+      }
+      prev[i % WINDOW_SIZE] = head[h];
+      head[h] = i;
+    }
+    if (best_length >= 3) {
+      put_match(band, best_length, best_distance);
+      // the bytes inside the match still go into the hash chains
+      for (size_t j = i + 1; j < i + best_length && j + 2 < size; j++) {
+        unsigned int h = ((raw[j] << 10) ^ (raw[j+1] << 5) ^ raw[j+2]) & (HASH_SIZE - 1);
+        prev[j % WINDOW_SIZE] = head[h];
+        head[h] = j;
+      }
+      i += best_length;
+    } else {
+      put_literal(band, raw[i]);
+      i++;
+    }
+  }
+  put_literal(band, 256);
+  if (!last) {
+    put_bits(band, 0, 3);
+  }
+  // flush the remaining bits
+  if (band->bit_count > 0) {
+    put_bits(band, 0, 8 - band->bit_count);
+  }
+  if (!last) {
+    put_byte(band, 0x00);
+    put_byte(band, 0x00);
+    put_byte(band, 0xff);
+    put_byte(band, 0xff);
+  }
+  free(head);
+  free(prev);
+}
+
+unsigned long adler32(unsigned char* data, size_t size) {
+  unsigned long a = 1;
+  unsigned long b = 0;
+  for (size_t i = 0; i < size; i++) {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+
+// adler32_combine() gives the adler32 of two blocks joined together from
+// their own checksums and the length of the second one
+unsigned long adler32_combine(unsigned long a1, unsigned long a2, size_t size2) {
+  unsigned long base = 65521;
+  unsigned long rem = size2 % base;
+  unsigned long sum1 = a1 & 0xffff;
+  unsigned long sum2 = (rem * sum1) % base;
+  sum1 += (a2 & 0xffff) + base - 1;
+  sum2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+  if (sum1 >= base) sum1 -= base;
+  if (sum1 >= base) sum1 -= base;
+  if (sum2 >= base * 2) sum2 -= base * 2;
+  if (sum2 >= base) sum2 -= base;
+  return sum1 | (sum2 << 16);
+}
+
+unsigned long crc_table[256];
+
+void make_crc_table() {
+  for (int n = 0; n < 256; n++) {
+    unsigned long c = n;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[n] = c;
+  }
+}
+
+unsigned long crc32(unsigned long crc, unsigned char* data, size_t size) {
+  crc ^= 0xffffffff;
+  for (size_t i = 0; i < size; i++) {
+    crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffff;
+}
+
+//////////////////////////////////////////////////////////
+// PNG                                                  //
+//////////////////////////////////////////////////////////
+
+static inline int paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  if (pb <= pc) return b;
+  return c;
+}
+
+// encode_png_band() filters the band's rows, trying each PNG filter on every
+// row and keeping the one with the smallest sum of absolute values, then
+// deflates them into an IDAT chunk with its CRC.
+void encode_png_band(Encoder* e, Band* band) {
+  int stride = e->width * 3;
+  band->raw_size = (size_t) band->rows * (stride + 1);
+  unsigned char* raw = malloc(band->raw_size);
+  unsigned char* zero = calloc(stride, 1);
+  unsigned char* trial = malloc(stride);
+  for (int r = 0; r < band->rows; r++) {
+    int y = band->first_row + r;
+    unsigned char* cur = (unsigned char*) &e->image[y * e->width];
+    unsigned char* up = y > 0 ? (unsigned char*) &e->image[(y - 1) * e->width] : zero;
+    unsigned char* out = &raw[r * (stride + 1)];
+    long best_sum = -1;
+    for (int filter = 0; filter < 5; filter++) {
+      long sum = 0;
+      for (int x = 0; x < stride; x++) {
+        int a = x >= 3 ? cur[x - 3] : 0;
+        int b = up[x];
+        int c = x >= 3 ? up[x - 3] : 0;
+        int predict = 0;
+        if (filter == 1) predict = a;
+        else if (filter == 2) predict = b;
+        else if (filter == 3) predict = (a + b) / 2;
+        else if (filter == 4) predict = paeth(a, b, c);
+        trial[x] = cur[x] - predict;
+        sum += trial[x] < 128 ? trial[x] : 256 - trial[x];
+      }
+      if (best_sum < 0 || sum < best_sum) {
+        best_sum = sum;
+        out[0] = filter;
+        memcpy(out + 1, trial, stride);
+      }
+    }
+  }
+  band->adler = adler32(raw, band->raw_size);
+
+  // chunk length is filled in once the data is known
+  put_be32(band, 0);
+  put_byte(band, 'I');
+  put_byte(band, 'D');
+  put_byte(band, 'A');
+  put_byte(band, 'T');
+  if (band->first_row == 0) {
+    // zlib header, deflate with a 32K window
+    put_byte(band, 0x78);
+    put_byte(band, 0x01);
+  }
+  deflate_band(band, raw, band->raw_size, band->first_row + band->rows == e->height);
+  size_t length = band->size - 8;
+  band->data[0] = length >> 24;
+  band->data[1] = length >> 16;
+  band->data[2] = length >> 8;
+  band->data[3] = length;
+  put_be32(band, crc32(0, band->data + 4, band->size - 4));
+
+  free(raw);
+  free(zero);
+  free(trial);
+}
+
+//////////////////////////////////////////////////////////
+// QOI                                                  //
+//////////////////////////////////////////////////////////
+
+#define QOI_HASH(p) (((p).red * 3 + (p).green * 5 + (p).blue * 7 + 255 * 11) % 64)
+
+static inline int same_pixel(Pixel a, Pixel b) {
+  return a.red == b.red && a.green == b.green && a.blue == b.blue;
+}
+
+// encode_qoi_band() encodes the band's pixels as QOI ops. The previous pixel
+// and the color index are first rebuilt as a decoder would have them at the
+// start of the band: each index slot holds the last earlier pixel with that
+// hash, found by scanning back until every slot is known. The scan stops after
+// one band's worth of pixels, since images that never fill some slots would
+// otherwise send every band back to the first pixel. Slots it doesn't reach
+// stay unknown and are never used for an index op, which only costs a few
+// bytes.
+void encode_qoi_band(Encoder* e, Band* band) {
+  Pixel index[64];
+  int known[64];
+  int missing = 64;
+  memset(index, 0, sizeof(index));
+  memset(known, 0, sizeof(known));
+  long start = (long) band->first_row * e->width;
+  long end = start + (long) band->rows * e->width;
+  // slots that stay unknown hold transparent black for the decoder, which
+  // no pixel of ours can match
+  long stop = start - (long) band->rows * e->width;
+  if (stop < 0) stop = 0;
+  for (long i = start - 1; i >= stop && missing > 0; i--) {
+    int h = QOI_HASH(e->image[i]);
+    if (!known[h]) {
+      known[h] = 1;
+      index[h] = e->image[i];
+      missing--;
+    }
+  }
+  Pixel prev = {0, 0, 0};
+  if (start > 0) {
+    prev = e->image[start - 1];
+  }
+
+  int run = 0;
+  for (long i = start; i < end; i++) {
+    Pixel px = e->image[i];
+    if (same_pixel(px, prev)) {
+      run++;
+      if (run == 62 || i == end - 1) {
+        put_byte(band, 0xc0 | (run - 1));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      put_byte(band, 0xc0 | (run - 1));
+      run = 0;
+    }
+    int h = QOI_HASH(px);
+    if (known[h] && same_pixel(index[h], px)) {
+      put_byte(band, 0x00 | h);
+    } else {
+      index[h] = px;
+      known[h] = 1;
+      signed char vr = px.red - prev.red;
+      signed char vg = px.green - prev.green;
+      signed char vb = px.blue - prev.blue;
+      signed char vg_r = vr - vg;
+      signed char vg_b = vb - vg;
+      if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+        put_byte(band, 0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+      } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+        put_byte(band, 0x80 | (vg + 32));
+        put_byte(band, (vg_r + 8) << 4 | (vg_b + 8));
+      } else {
+        put_byte(band, 0xfe);
+        put_byte(band, px.red);
+        put_byte(band, px.green);
+        put_byte(band, px.blue);
+      }
+    }
+    prev = px;
+  }
+}
+
+//////////////////////////////////////////////////////////
+// BAND SCHEDULING                                      //
+//////////////////////////////////////////////////////////
+
+// encode_worker() takes bands in order and encodes each one once the
+// renderer has finished its rows
+void* encode_worker(void* arg) {
+  Encoder* e = arg;
+  while (1) {
+    pthread_mutex_lock(&e->lock);
+    if (e->next_band == e->band_count) {
+      pthread_mutex_unlock(&e->lock);
+      return NULL;
+    }
+    Band* band = &e->bands[e->next_band++];
+    while (e->rows_done < band->first_row + band->rows) {
+      pthread_cond_wait(&e->ready, &e->lock);
+    }
+    pthread_mutex_unlock(&e->lock);
+    if (e->format == FORMAT_PNG) {
+      encode_png_band(e, band);
+    } else {
+      encode_qoi_band(e, band);
+    }
+  }
+}
+
+// start_encoder() splits the image into bands and starts one worker per
+// core. The workers wait for rows_finished() to hand them rows.
+void start_encoder(Encoder* e, int format, Pixel* image, int width, int height) {
+  e->format = format;
+  e->image = image;
+  e->width = width;
+  e->height = height;
+  e->thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  if (e->thread_count < 1) e->thread_count = 1;
+  // a few bands per worker keeps them busy while the render goes on
+  int band_rows = height / (e->thread_count * 4);
+  if (band_rows < 16) band_rows = 16;
+  e->band_count = (height + band_rows - 1) / band_rows;
+  e->bands = calloc(e->band_count, sizeof(Band));
+  for (int b = 0; b < e->band_count; b++) {
+    e->bands[b].first_row = b * band_rows;
+    e->bands[b].rows = b == e->band_count - 1 ? height - b * band_rows : band_rows;
+  }
+  e->next_band = 0;
+  e->rows_done = 0;
+  if (format == FORMAT_PNG) {
+    make_crc_table();
+  }
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->ready, NULL);
+  e->threads = malloc(e->thread_count * sizeof(pthread_t));
+  for (int t = 0; t < e->thread_count; t++) {
+    pthread_create(&e->threads[t], NULL, encode_worker, e);
+  }
+}
+
+// rows_finished() tells the workers the first rows of the image are done
+void rows_finished(Encoder* e, int rows) {
+  pthread_mutex_lock(&e->lock);
+  e->rows_done = rows;
+  pthread_cond_broadcast(&e->ready);
+  pthread_mutex_unlock(&e->lock);
+}
+
+// finish_encoder() waits for the last bands and writes the file, header
+// first, then the bands in order, then the trailer
+void finish_encoder(Encoder* e, FILE* output) {
+  rows_finished(e, e->height);
+  for (int t = 0; t < e->thread_count; t++) {
+    pthread_join(e->threads[t], NULL);
+  }
+  Band head = {0};
+  Band tail = {0};
+  if (e->format == FORMAT_PNG) {
+    static unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    fwrite(signature, 8, 1, output);
+    put_be32(&head, 13);
+    put_byte(&head, 'I');
+    put_byte(&head, 'H');
+    put_byte(&head, 'D');
+    put_byte(&head, 'R');
+    put_be32(&head, e->width);
+    put_be32(&head, e->height);
+    put_byte(&head, 8); // bit depth
+    put_byte(&head, 2); // RGB
+    put_byte(&head, 0);
+    put_byte(&head, 0);
+    put_byte(&head, 0);
+    put_be32(&head, crc32(0, head.data + 4, head.size - 4));
+
+    // the zlib checksum closes the stream in one last IDAT chunk
+    unsigned long adler = e->bands[0].adler;
+    for (int b = 1; b < e->band_count; b++) {
+      adler = adler32_combine(adler, e->bands[b].adler, e->bands[b].raw_size);
+    }
+    put_be32(&tail, 4);
+    put_byte(&tail, 'I');
+    put_byte(&tail, 'D');
+    put_byte(&tail, 'A');
+    put_byte(&tail, 'T');
+    put_be32(&tail, adler);
+    put_be32(&tail, crc32(0, tail.data + 4, tail.size - 4));
+    put_be32(&tail, 0);
+    size_t iend = tail.size;
+    put_byte(&tail, 'I');
+    put_byte(&tail, 'E');
+    put_byte(&tail, 'N');
+    put_byte(&tail, 'D');
+    put_be32(&tail, crc32(0, tail.data + iend, 4));
+  } else {
+    put_byte(&head, 'q');
+    put_byte(&head, 'o');
+    put_byte(&head, 'i');
+    put_byte(&head, 'f');
+    put_be32(&head, e->width);
+    put_be32(&head, e->height);
+    put_byte(&head, 3); // RGB
+    put_byte(&head, 0); // sRGB
+    for (int i = 0; i < 7; i++) {
+      put_byte(&tail, 0);
+    }
+    put_byte(&tail, 1);
+  }
+  fwrite(head.data, head.size, 1, output);
+  for (int b = 0; b < e->band_count; b++) {
+    fwrite(e->bands[b].data, e->bands[b].size, 1, output);
+    free(e->bands[b].data);
+  }
+  fwrite(tail.data, tail.size, 1, output);
+  free(head.data);
+  free(tail.data);
+  free(e->bands);
+  free(e->threads);
+  pthread_mutex_destroy(&e->lock);
+  pthread_cond_destroy(&e->ready);
+}
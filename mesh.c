@@ -0,0 +1,425 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// TRIANGLE MESHES
+//
+// A mesh is loaded once per OBJ file and shared by every mesh object in the
+// scene that names that file. The objects only carry a position, a rotation
+// and a uniform scale, so the same vertex data can be instanced as many times
+// as needed.
+
+// triangles per BVH leaf, the leaf test runs over all of them at once, one
+// per lane of a vec4
+#define LEAF_SIZE 4
+
+// four doubles worked on together, split into SSE pairs where AVX is missing
+typedef double vec4 __attribute__ ((vector_size (32)));
+// lane masks from comparing vec4s, all ones where the comparison holds
+typedef long long mask4 __attribute__ ((vector_size (32)));
+
+// BVH NODE STRUCTURE, AN AXIS ALIGNED BOX AROUND ITS TRIANGLES
+typedef struct {
+  double min[3];
+  double max[3];
+  int first; // first child for inner nodes, first triangle slot for leaves
+  int count; // number of triangles in a leaf, 0 for inner nodes
+} BVHNode;
+
+// MESH STRUCTURE SHARED BY ALL INSTANCES OF ONE OBJ FILE
+typedef struct Mesh {
+  char* filename;
+  int triangle_count;
+  // triangles in BVH leaf order, split into one array per coordinate so a
+  // leaf loads as one vec4 per coordinate. Each leaf takes LEAF_SIZE slots,
+  // and slots past the end of a leaf hold empty triangles that never hit.
+  double* v0[3];
+  double* e1[3];
+  double* e2[3];
+  BVHNode* nodes;
+  int node_count;
+  double min[3];
+  double max[3];
+  struct Mesh* next;
+} Mesh;
+
+Mesh* meshes = NULL;
+int mesh_line = 1;
+
+// mesh_number() reads a number from the OBJ text at *p without running past
+// end, the mapped file is not null terminated.
+double mesh_number(const char** p, const char* end) {
+  char buffer[64];
+  int i = 0;
+  while (*p < end && (**p == ' ' || **p == '\t')) (*p)++;
+  while (*p < end && i < 63 && !isspace(**p) && **p != '/') {
+    buffer[i++] = *(*p)++;
+  }
+  buffer[i] = 0;
+  char* stop;
+  double value = strtod(buffer, &stop);
+  if (i == 0 || *stop != 0) {
+    fprintf(stderr, "Error: Expected number on line %d of mesh file.\n", mesh_line);
+    exit(1);
+  }
+  return value;
+}
+
+// mesh_index() reads one face vertex like "3", "3/1" or "3/1/2" and returns
+// the zero based position index
+int mesh_index(const char** p, const char* end, int vertex_count) {
+  int index = (int) mesh_number(p, end);
+  // skip texture and normal indices
+  while (*p < end && !isspace(**p)) (*p)++;
+  if (index < 0) {
+    index = vertex_count + index + 1;
+  }
+  if (index < 1 || index > vertex_count) {
+    fprintf(stderr, "Error: Vertex index out of range on line %d of mesh file.\n", mesh_line);
+    exit(1);
+  }
+  return index - 1;
+}
+
+double* sort_centroids;
+int sort_axis;
+
+int compare_centroids(const void* a, const void* b) {
+  double ca = sort_centroids[*(const int*) a * 3 + sort_axis];
+  double cb = sort_centroids[*(const int*) b * 3 + sort_axis];
+  return (ca > cb) - (ca < cb);
+}
+
+// build_bvh() fills in node for triangles first..first+count of order, then
+// splits them at the median of the longest axis of their centroids. The two
+// children of a node are always stored next to each other.
+void build_bvh(Mesh* mesh, int node, int* order, double* centroids, double* tri, int first, int count) {
+  BVHNode* n = &mesh->nodes[node];
+  double cmin[3] = {INFINITY, INFINITY, INFINITY};
+  double cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+  for (int k = 0; k < 3; k++) {
+    n->min[k] = INFINITY;
+    n->max[k] = -INFINITY;
+  }
+  for (int i = first; i < first + count; i++) {
+    for (int v = 0; v < 3; v++) {
+      for (int k = 0; k < 3; k++) {
+        double x = tri[order[i]*9 + v*3 + k];
+        if (x < n->min[k]) n->min[k] = x;
+        if (x > n->max[k]) n->max[k] = x;
+      }
+    }
+    for (int k = 0; k < 3; k++) {
+      double c = centroids[order[i]*3 + k];
+      if (c < cmin[k]) cmin[k] = c;
+      if (c > cmax[k]) cmax[k] = c;
+    }
+  }
+  if (count <= LEAF_SIZE) {
+    n->first = first;
+    n->count = count;
+    return;
+  }
+  int axis = 0;
+  for (int k = 1; k < 3; k++) {
+    if (cmax[k] - cmin[k] > cmax[axis] - cmin[axis]) axis = k;
+  }
+  sort_centroids = centroids;
+  sort_axis = axis;
+  qsort(&order[first], count, sizeof(int), compare_centroids);
+
+  int children = mesh->node_count;
+  mesh->node_count += 2;
+  n->first = children;
+  n->count = 0;
+  int half = count / 2;
+  build_bvh(mesh, children, order, centroids, tri, first, half);
+  build_bvh(mesh, children + 1, order, centroids, tri, first + half, count - half);
+}
+
+// load_mesh() maps an OBJ file into memory, reads its vertices and faces and
+// builds the BVH. Faces with more than three vertices are split into a fan.
+// Meshes are cached by file name so instances share one copy.
+Mesh* load_mesh(char* filename) {
+  for (Mesh* m = meshes; m != NULL; m = m->next) {
+    if (strcmp(m->filename, filename) == 0) return m;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Could not open mesh file \"%s\"\n", filename);
+    exit(1);
+  }
+  struct stat st;
+  fstat(fd, &st);
+  const char* text = NULL;
+  if (st.st_size > 0) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+      fprintf(stderr, "Error: Could not map mesh file \"%s\"\n", filename);
+      exit(1);
+    }
+  }
+  close(fd);
+  const char* end = text + st.st_size;
+
+  int vertex_count = 0;
+  int vertex_size = 1024;
+  double* vertices = malloc(vertex_size * 3 * sizeof(double));
+  int triangle_count = 0;
+  int triangle_size = 1024;
+  double* tri = malloc(triangle_size * 9 * sizeof(double));
+
+  mesh_line = 1;
+  const char* p = text;
+  while (p < end) {
+    if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+      p++;
+      if (vertex_count == vertex_size) {
+        vertex_size *= 2;
+        vertices = realloc(vertices, vertex_size * 3 * sizeof(double));
+      }
+      for (int k = 0; k < 3; k++) {
+        vertices[vertex_count*3 + k] = mesh_number(&p, end);
+      }
+      vertex_count++;
+    } else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+      p++;
+      int a = mesh_index(&p, end, vertex_count);
+      int b = mesh_index(&p, end, vertex_count);
+      while (1) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        if (p == end || *p == '\n' || *p == '#') break;
+        int c = mesh_index(&p, end, vertex_count);
+        if (triangle_count == triangle_size) {
+          triangle_size *= 2;
+          tri = realloc(tri, triangle_size * 9 * sizeof(double));
+        }
+        int corners[3] = {a, b, c};
+        for (int v = 0; v < 3; v++) {
+          for (int k = 0; k < 3; k++) {
+            tri[triangle_count*9 + v*3 + k] = vertices[corners[v]*3 + k];
+          }
+        }
+        triangle_count++;
+        b = c;
+      }
+    }
+    // anything else (normals, texture coordinates, groups, comments) is
+    // skipped along with the rest of the line
+    while (p < end && *p != '\n') p++;
+    if (p < end) {
+      p++;
+      mesh_line++;
+    }
+  }
+  if (text != NULL) {
+    munmap((void*) text, st.st_size);
+  }
+  free(vertices);
+  if (triangle_count == 0) {
+    fprintf(stderr, "Error: Mesh file \"%s\" has no faces.\n", filename);
+    exit(1);
+  }
+
+  Mesh* mesh = malloc(sizeof(Mesh));
+  mesh->filename = strdup(filename);
+  mesh->triangle_count = triangle_count;
+  mesh->nodes = malloc(2 * triangle_count * sizeof(BVHNode));
+  mesh->node_count = 1;
+
+  int* order = malloc(triangle_count * sizeof(int));
+  double* centroids = malloc(triangle_count * 3 * sizeof(double));
+  for (int i = 0; i < triangle_count; i++) {
+    order[i] = i;
+    for (int k = 0; k < 3; k++) {
+      centroids[i*3 + k] = (tri[i*9 + k] + tri[i*9 + 3 + k] + tri[i*9 + 6 + k]) / 3;
+    }
+  }
+  build_bvh(mesh, 0, order, centroids, tri, 0, triangle_count);
+
+  // store the triangles in leaf order with their edges precomputed, every
+  // leaf padded to LEAF_SIZE slots with zeroed triangles
+  int leaves = 0;
+  for (int i = 0; i < mesh->node_count; i++) {
+    if (mesh->nodes[i].count > 0) leaves++;
+  }
+  size_t slots_size = (size_t) leaves * LEAF_SIZE * sizeof(double);
+  for (int k = 0; k < 3; k++) {
+    mesh->v0[k] = aligned_alloc(sizeof(vec4), slots_size);
+    mesh->e1[k] = aligned_alloc(sizeof(vec4), slots_size);
+    mesh->e2[k] = aligned_alloc(sizeof(vec4), slots_size);
+    if (mesh->v0[k] == NULL || mesh->e1[k] == NULL || mesh->e2[k] == NULL) {
+      fprintf(stderr, "Error: Out of memory loading mesh \"%s\".\n", filename);
+      exit(1);
+    }
+    memset(mesh->v0[k], 0, slots_size);
+    memset(mesh->e1[k], 0, slots_size);
+    memset(mesh->e2[k], 0, slots_size);
+    mesh->min[k] = mesh->nodes[0].min[k];
+    mesh->max[k] = mesh->nodes[0].max[k];
+  }
+  int slot = 0;
+  for (int i = 0; i < mesh->node_count; i++) {
+    BVHNode* n = &mesh->nodes[i];
+    if (n->count == 0) continue;
+    for (int j = 0; j < n->count; j++) {
+      double* t = &tri[order[n->first + j]*9];
+      for (int k = 0; k < 3; k++) {
+        mesh->v0[k][slot + j] = t[k];
+        mesh->e1[k][slot + j] = t[3 + k] - t[k];
+        mesh->e2[k][slot + j] = t[6 + k] - t[k];
+      }
+    }
+    n->first = slot;
+    slot += LEAF_SIZE;
+  }
+  free(order);
+  free(centroids);
+  free(tri);
+
+  printf("Loaded mesh \"%s\" with %d triangles.\n", filename, triangle_count);
+  mesh->next = meshes;
+  meshes = mesh;
+  return mesh;
+}
+
+// box_intersection() is the slab test, returning the distance the ray enters
+// the box or INFINITY if it misses it
+static inline double box_intersection(double* Ro, double* inv, double* min, double* max) {
+  double tmin = 0;
+  double tmax = INFINITY;
+  for (int k = 0; k < 3; k++) {
+    double t0 = (min[k] - Ro[k]) * inv[k];
+    double t1 = (max[k] - Ro[k]) * inv[k];
+    if (t0 > t1) {
+      double swap = t0;
+      t0 = t1;
+      t1 = swap;
+    }
+    if (t0 > tmin) tmin = t0;
+    if (t1 < tmax) tmax = t1;
+  }
+  return tmin <= tmax ? tmin : INFINITY;
+}
+
+// leaf_intersection() runs the Moller-Trumbore test on the LEAF_SIZE
+// triangle slots starting at first, one triangle per vector lane. The hit
+// test is a lane mask instead of a branch, empty slots fail it on det == 0,
+// and the nearest hit is picked from the lanes afterwards.
+static inline int leaf_intersection(Mesh* mesh, int first, double* Ro, double* Rd, double* best_t) {
+  vec4 e1x = *(vec4*) &mesh->e1[0][first];
+  vec4 e1y = *(vec4*) &mesh->e1[1][first];
+  vec4 e1z = *(vec4*) &mesh->e1[2][first];
+  vec4 e2x = *(vec4*) &mesh->e2[0][first];
+  vec4 e2y = *(vec4*) &mesh->e2[1][first];
+  vec4 e2z = *(vec4*) &mesh->e2[2][first];
+  vec4 px = Rd[1]*e2z - Rd[2]*e2y;
+  vec4 py = Rd[2]*e2x - Rd[0]*e2z;
+  vec4 pz = Rd[0]*e2y - Rd[1]*e2x;
+  vec4 det = e1x*px + e1y*py + e1z*pz;
+  vec4 inv = 1.0 / det;
+  vec4 sx = Ro[0] - *(vec4*) &mesh->v0[0][first];
+  vec4 sy = Ro[1] - *(vec4*) &mesh->v0[1][first];
+  vec4 sz = Ro[2] - *(vec4*) &mesh->v0[2][first];
+  vec4 u = (sx*px + sy*py + sz*pz) * inv;
+  vec4 qx = sy*e1z - sz*e1y;
+  vec4 qy = sz*e1x - sx*e1z;
+  vec4 qz = sx*e1y - sy*e1x;
+  vec4 v = (Rd[0]*qx + Rd[1]*qy + Rd[2]*qz) * inv;
+  vec4 d = (e2x*qx + e2y*qy + e2z*qz) * inv;
+  mask4 hit = (det != 0.0) & (u >= 0.0) & (v >= 0.0) & (u + v <= 1.0) & (d > 1e-6);
+  vec4 miss = {INFINITY, INFINITY, INFINITY, INFINITY};
+  vec4 t = (vec4) (((mask4) d & hit) | ((mask4) miss & ~hit));
+  int best = -1;
+  for (int i = 0; i < LEAF_SIZE; i++) {
+    if (t[i] < *best_t) {
+      *best_t = t[i];
+      best = first + i;
+    }
+  }
+  return best;
+}
+
+// rotation_matrix() builds the row major matrix R turning mesh space into
+// scene space from angles in degrees, rotating about x first, then y, then z
+void rotation_matrix(double* degrees, double* R) {
+  double c[3];
+  double s[3];
+  for (int k = 0; k < 3; k++) {
+    c[k] = cos(degrees[k] * M_PI / 180);
+    s[k] = sin(degrees[k] * M_PI / 180);
+  }
+  // Rz * Ry * Rx written out
+  R[0] = c[2]*c[1];
+  R[1] = c[2]*s[1]*s[0] - s[2]*c[0];
+  R[2] = c[2]*s[1]*c[0] + s[2]*s[0];
+  R[3] = s[2]*c[1];
+  R[4] = s[2]*s[1]*s[0] + c[2]*c[0];
+  R[5] = s[2]*s[1]*c[0] - c[2]*s[0];
+  R[6] = -s[1];
+  R[7] = c[1]*s[0];
+  R[8] = c[1]*c[0];
+}
+
+// mesh_intersection() intersects a ray with one instance of a mesh. The ray
+// is moved into the mesh's own space instead of moving the mesh, by the
+// inverse of the rotation R, which is its transpose, and the scale. Since the
+// scale is uniform the distance along the ray stays the same. The normal
+// at the hit is written to N, turned to face the ray. Hits closer than a
+// small epsilon are ignored, so a ray leaving the mesh does not hit the
+// triangle it starts on, while other parts of a concave mesh still can.
+double mesh_intersection(double* Ro, double* Rd, double* C, double s, double* R, Mesh* mesh, double* N) {
+  double Rol[3];
+  double Rdl[3];
+  double inv[3];
+  double d[3] = {Ro[0] - C[0], Ro[1] - C[1], Ro[2] - C[2]};
+  for (int k = 0; k < 3; k++) {
+    Rol[k] = (R[k]*d[0] + R[3 + k]*d[1] + R[6 + k]*d[2]) / s;
+    Rdl[k] = (R[k]*Rd[0] + R[3 + k]*Rd[1] + R[6 + k]*Rd[2]) / s;
+    inv[k] = 1.0 / Rdl[k];
+  }
+  double best_t = INFINITY;
+  int best = -1;
+  int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    BVHNode* n = &mesh->nodes[stack[--top]];
+    if (box_intersection(Rol, inv, n->min, n->max) >= best_t) continue;
+    if (n->count > 0) {
+      int hit = leaf_intersection(mesh, n->first, Rol, Rdl, &best_t);
+      if (hit >= 0) best = hit;
+    } else {
+      // visit the nearer child first so farther boxes get culled
+      int left = n->first;
+      int right = n->first + 1;
+      double tl = box_intersection(Rol, inv, mesh->nodes[left].min, mesh->nodes[left].max);
+      double tr = box_intersection(Rol, inv, mesh->nodes[right].min, mesh->nodes[right].max);
+      if (tl < tr) {
+        if (tr < best_t) stack[top++] = right;
+        if (tl < best_t) stack[top++] = left;
+      } else {
+        if (tl < best_t) stack[top++] = left;
+        if (tr < best_t) stack[top++] = right;
+      }
+    }
+  }
+  if (best < 0) return -1;
+  double Nl[3];
+  Nl[0] = mesh->e1[1][best]*mesh->e2[2][best] - mesh->e1[2][best]*mesh->e2[1][best];
+  Nl[1] = mesh->e1[2][best]*mesh->e2[0][best] - mesh->e1[0][best]*mesh->e2[2][best];
+  Nl[2] = mesh->e1[0][best]*mesh->e2[1][best] - mesh->e1[1][best]*mesh->e2[0][best];
+  // normals take the inverse transpose of the transform, for a rotation and
+  // a uniform scale that is the rotation itself up to length
+  for (int k = 0; k < 3; k++) {
+    N[k] = R[k*3]*Nl[0] + R[k*3 + 1]*Nl[1] + R[k*3 + 2]*Nl[2];
+  }
+  if (N[0]*Rd[0] + N[1]*Rd[1] + N[2]*Rd[2] > 0) {
+    N[0] = -N[0];
+    N[1] = -N[1];
+    N[2] = -N[2];
+  }
+  return best_t;
+}
@@ -3,10 +3,20 @@
 #include <math.h>
 #include <ctype.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// OBJECT STRUCTURE THAT ALLOWS FOR ALL 3 OBJECTS
+struct Mesh;
+struct ClusterFile;
+
+// OBJECT STRUCTURE THAT ALLOWS FOR ALL 6 OBJECTS
 typedef struct {
-  int kind; // 0 = camera, 1 = sphere, 2 = plane, 3 = light
+  int kind; // 0 = camera, 1 = sphere, 2 = plane, 3 = light, 4 = mesh, 5 = clusters
   union {
     struct {
       double width;
@@ -38,6 +48,24 @@ typedef struct {
 	  double radial[3];
 	  double angular;
 	} light;
+    struct {
+      double position[3];
+      double scale;
+      // degrees about x, then y, then z, and the matrix built from them
+      double rotation[3];
+      double matrix[9];
+      double diffuse[3];
+      double specular[3];
+      double reflectivity;
+      double refractivity;
+      double ior;
+      char* file;
+      struct Mesh* data;
+    } mesh;
+    struct {
+      char* file;
+      struct ClusterFile* data;
+    } clusters;
   };
 } Object;
 
@@ -48,10 +76,37 @@ typedef struct Pixel{
 	unsigned char blue;
 } Pixel;
 
-// OBJECT ARRAY TO READ FROM JSON FILE INTO
-Object* object_array[128];
+// OBJECT ARRAY TO READ FROM JSON FILE INTO, ENDS WITH NULL
+Object** object_array;
 int obj = 0;
-int line = 1;
+// each parsing thread keeps its own line count
+__thread int line = 1;
+// where the parsing thread reports problems, and where it jumps back to
+// once an error ends its chunk
+__thread FILE* parse_log = NULL;
+__thread jmp_buf* parse_abort = NULL;
+
+// parse_warning() reports a problem the parse can carry on after
+void parse_warning(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(parse_log != NULL ? parse_log : stderr, format, args);
+  va_end(args);
+}
+
+// parse_error() reports a syntax error and stops parsing. Threads don't exit
+// themselves, they give up on their chunk and read_scene() reports the first
+// error in the file once all chunks are done.
+__attribute__ ((noreturn)) void parse_error(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vfprintf(parse_log != NULL ? parse_log : stderr, format, args);
+  va_end(args);
+  if (parse_abort == NULL) {
+    exit(1);
+  }
+  longjmp(*parse_abort, 1);
+}
 
 // next_c() wraps the getc() function and provides error checking and line
 // number maintenance
@@ -64,8 +119,7 @@ int next_c(FILE* json) {
     line += 1;
   }
   if (c == EOF) {
-    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-    exit(1);
+    parse_error("Error: Unexpected end of file on line number %d.\n", line);
   }
   return c;
 }
@@ -76,8 +130,7 @@ int next_c(FILE* json) {
 void expect_c(FILE* json, int d) {
   int c = next_c(json);
   if (c == d) return;
-  fprintf(stderr, "Error: Expected '%c' on line %d.\n", d, line);
-  exit(1);    
+  parse_error("Error: Expected '%c' on line %d.\n", d, line);
 }
 
 
@@ -97,23 +150,19 @@ char* next_string(FILE* json) {
   char buffer[129];
   int c = next_c(json);
   if (c != '"') {
-    fprintf(stderr, "Error: Expected string on line %d.\n", line);
-    exit(1);
+    parse_error("Error: Expected string on line %d.\n", line);
   }  
   c = next_c(json);
   int i = 0;
   while (c != '"') {
     if (i >= 128) {
-      fprintf(stderr, "Error: Strings longer than 128 characters in length are not supported.\n");
-      exit(1);      
+      parse_error("Error: Strings longer than 128 characters in length are not supported.\n");
     }
     if (c == '\\') {
-      fprintf(stderr, "Error: Strings with escape codes are not supported.\n");
-      exit(1);      
+      parse_error("Error: Strings with escape codes are not supported.\n");
     }
     if (c < 32 || c > 126) {
-      fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
-      exit(1);
+      parse_error("Error: Strings may contain only ascii characters.\n");
     }
     buffer[i] = c;
     i += 1;
@@ -149,76 +198,51 @@ double* next_vector(FILE* json) {
 }
 
 
-void read_scene(char* filename) {
+// read_object() parses the fields of one object into o. The opening '{' has
+// already been read, and the closing '}' is consumed.
+void read_object(FILE* json, Object* o) {
   int c;
-  FILE* json = fopen(filename, "r");
+  skip_ws(json);
 
-  if (json == NULL) {
-    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
-    exit(1);
+  // Parse the object
+  char* key = next_string(json);
+  if (strcmp(key, "type") != 0) {
+		parse_error("Error: Expected \"type\" key on line number %d.\n", line);
   }
-  
-  skip_ws(json);
-  
-  // Find the beginning of the list
-  expect_c(json, '[');
 
   skip_ws(json);
 
-  // Find the objects
-
-  while (1) {
-    c = fgetc(json);
-    if (c == ']') {
-      fprintf(stderr, "Error: This is the worst scene file EVER.\n");
-      fclose(json);
-      return;
-    }
-    if (c == '{') {
-      skip_ws(json);
-    
-      // Parse the object
-      char* key = next_string(json);
-      if (strcmp(key, "type") != 0) {
-		fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
-		exit(1);
-      }
-
-      skip_ws(json);
-
-      expect_c(json, ':');
+  expect_c(json, ':');
 
-      skip_ws(json);
+  skip_ws(json);
 
-      char* value = next_string(json);
-  	  object_array[obj] = malloc(sizeof(Object));
-	  Object new;
+  char* value = next_string(json);
 			// IDENTIFYING OBJECT TYPES AND BUILDING OBJECT
-      if (strcmp(value, "camera") == 0) {
-				(*object_array[obj]).kind = 0;
-				printf("Found camera\n");
-      } else if (strcmp(value, "sphere") == 0) {
-				(*object_array[obj]).kind = 1;
-				printf("Found sphere\n");
-      } else if (strcmp(value, "plane") == 0) {
-				(*object_array[obj]).kind = 2;
-				printf("Found plane\n");
-      } else if (strcmp(value, "light") == 0) {
-				(*object_array[obj]).kind = 3;
-				printf("Found light\n");
-      } else {
-				fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
-				exit(1);
-      }
+  if (strcmp(value, "camera") == 0) {
+				(*o).kind = 0;
+  } else if (strcmp(value, "sphere") == 0) {
+				(*o).kind = 1;
+  } else if (strcmp(value, "plane") == 0) {
+				(*o).kind = 2;
+  } else if (strcmp(value, "light") == 0) {
+				(*o).kind = 3;
+  } else if (strcmp(value, "mesh") == 0) {
+				(*o).kind = 4;
+				(*o).mesh.scale = 1;
+				(*o).mesh.file = NULL;
+  } else if (strcmp(value, "clusters") == 0) {
+				(*o).kind = 5;
+				(*o).clusters.file = NULL;
+  } else {
+				parse_error("Error: Unknown type, \"%s\", on line number %d.\n", value, line);
+  }
 
-      skip_ws(json);
+  skip_ws(json);
 
-      while (1) {
+  while (1) {
 		c = next_c(json);
 		if (c == '}') {
 	  	// stop parsing this object
-	  		//object_array[obj] = &new;
-			obj++;
 	  		break;
 	  } else if (c == ',') {
 	  	// read another field
@@ -241,51 +265,60 @@ void read_scene(char* filename) {
 	  (strcmp(key, "ior") == 0)) {
 	    	double value = next_number(json);
 			if(strcmp(key, "width") == 0){
-				if((*object_array[obj]).kind == 0) (*object_array[obj]).camera.width = value;
+				if((*o).kind == 0) (*o).camera.width = value;
 			}
 			else if(strcmp(key, "height") == 0){
-				if((*object_array[obj]).kind == 0) (*object_array[obj]).camera.height = value;
+				if((*o).kind == 0) (*o).camera.height = value;
 			}
 			else if(strcmp(key, "radius") == 0){
-				(*object_array[obj]).sphere.radius = value;
+				(*o).sphere.radius = value;
 			}
 			else if(strcmp(key, "theta") == 0) {
-				(*object_array[obj]).light.theta = value;
+				(*o).light.theta = value;
 			}
 			else if(strcmp(key, "radial-a2") == 0) {
-				(*object_array[obj]).light.radial[2] = value;
+				(*o).light.radial[2] = value;
 			}
 			else if(strcmp(key, "radial-a1") == 0) {
-				(*object_array[obj]).light.radial[1] = value;
+				(*o).light.radial[1] = value;
 			}
 			else if(strcmp(key, "radial-a0") == 0) {
-				(*object_array[obj]).light.radial[0] = value;
+				(*o).light.radial[0] = value;
 			}
 			else if(strcmp(key, "angular-a0") == 0) {
-				(*object_array[obj]).light.angular = value;
+				(*o).light.angular = value;
 			}
 			else if(strcmp(key, "reflectivity") == 0){
-				if((*object_array[obj]).kind == 1) {
-					(*object_array[obj]).sphere.reflectivity = value;
+				if((*o).kind == 1) {
+					(*o).sphere.reflectivity = value;
 				}
-				else if ((*object_array[obj]).kind == 2) {
-					(*object_array[obj]).plane.reflectivity = value;
+				else if ((*o).kind == 2) {
+					(*o).plane.reflectivity = value;
+				}
+				else if ((*o).kind == 4) {
+					(*o).mesh.reflectivity = value;
 				}
 			}
 			else if(strcmp(key, "refractivity") == 0){
-				if((*object_array[obj]).kind == 1) {
-					(*object_array[obj]).sphere.refractivity = value;
+				if((*o).kind == 1) {
+					(*o).sphere.refractivity = value;
+				}
+				else if ((*o).kind == 2) {
+					(*o).plane.refractivity = value;
 				}
-				else if ((*object_array[obj]).kind == 2) {
-					(*object_array[obj]).plane.refractivity = value;
+				else if ((*o).kind == 4) {
+					(*o).mesh.refractivity = value;
 				}
 			}
 			else if(strcmp(key, "ior") == 0){
-				if((*object_array[obj]).kind == 1) {
-					(*object_array[obj]).sphere.ior = value;
+				if((*o).kind == 1) {
+					(*o).sphere.ior = value;
+				}
+				else if ((*o).kind == 2) {
+					(*o).plane.ior = value;
 				}
-				else if ((*object_array[obj]).kind == 2) {
-					(*object_array[obj]).plane.ior = value;
+				else if ((*o).kind == 4) {
+					(*o).mesh.ior = value;
 				}
 			}
 		// BUILDING OBJECT VECTOR FIELDS
@@ -297,86 +330,310 @@ void read_scene(char* filename) {
 		     (strcmp(key, "direction") == 0)) {
 	    	double* value = next_vector(json);
 			if(strcmp(key, "color") == 0){
-				(*object_array[obj]).light.color[0] = value[0];
-				(*object_array[obj]).light.color[1] = value[1];
-				(*object_array[obj]).light.color[2] = value[2];
+				(*o).light.color[0] = value[0];
+				(*o).light.color[1] = value[1];
+				(*o).light.color[2] = value[2];
 			}
 			else if(strcmp(key, "position") == 0){
-				if((*object_array[obj]).kind == 1){
-					(*object_array[obj]).sphere.position[0] = value[0];
-					(*object_array[obj]).sphere.position[1] = value[1];
-					(*object_array[obj]).sphere.position[2] = value[2];
+				if((*o).kind == 1){
+					(*o).sphere.position[0] = value[0];
+					(*o).sphere.position[1] = value[1];
+					(*o).sphere.position[2] = value[2];
 				}
-				else if((*object_array[obj]).kind == 2){
-					(*object_array[obj]).plane.position[0] = value[0];
-					(*object_array[obj]).plane.position[1] = value[1];
-					(*object_array[obj]).plane.position[2] = value[2];
+				else if((*o).kind == 2){
+					(*o).plane.position[0] = value[0];
+					(*o).plane.position[1] = value[1];
+					(*o).plane.position[2] = value[2];
 				}
-				else if((*object_array[obj]).kind == 3){
-					(*object_array[obj]).light.position[0] = value[0];
-					(*object_array[obj]).light.position[1] = value[1];
-					(*object_array[obj]).light.position[2] = value[2];
+				else if((*o).kind == 4){
+					(*o).mesh.position[0] = value[0];
+					(*o).mesh.position[1] = value[1];
+					(*o).mesh.position[2] = value[2];
+				}
+				else if((*o).kind == 3){
+					(*o).light.position[0] = value[0];
+					(*o).light.position[1] = value[1];
+					(*o).light.position[2] = value[2];
 				}
 			}
 			else if(strcmp(key, "normal") == 0){
-				(*object_array[obj]).plane.normal[0] = value[0];
-				(*object_array[obj]).plane.normal[1] = value[1];
-				(*object_array[obj]).plane.normal[2] = value[2];
+				(*o).plane.normal[0] = value[0];
+				(*o).plane.normal[1] = value[1];
+				(*o).plane.normal[2] = value[2];
 			}
 			else if(strcmp(key, "diffuse_color") == 0){
-				if((*object_array[obj]).kind == 1){
-					(*object_array[obj]).sphere.diffuse[0] = value[0];
-					(*object_array[obj]).sphere.diffuse[1] = value[1];
-					(*object_array[obj]).sphere.diffuse[2] = value[2];
+				if((*o).kind == 1){
+					(*o).sphere.diffuse[0] = value[0];
+					(*o).sphere.diffuse[1] = value[1];
+					(*o).sphere.diffuse[2] = value[2];
+				}
+				else if((*o).kind == 2){
+					(*o).plane.diffuse[0] = value[0];
+					(*o).plane.diffuse[1] = value[1];
+					(*o).plane.diffuse[2] = value[2];
 				}
-				else if((*object_array[obj]).kind == 2){
-					(*object_array[obj]).plane.diffuse[0] = value[0];
-					(*object_array[obj]).plane.diffuse[1] = value[1];
-					(*object_array[obj]).plane.diffuse[2] = value[2];
+				else if((*o).kind == 4){
+					(*o).mesh.diffuse[0] = value[0];
+					(*o).mesh.diffuse[1] = value[1];
+					(*o).mesh.diffuse[2] = value[2];
 				}
 			}
 			else if(strcmp(key, "specular_color") == 0){
-				if((*object_array[obj]).kind == 1){
-					(*object_array[obj]).sphere.specular[0] = value[0];
-					(*object_array[obj]).sphere.specular[1] = value[1];
-					(*object_array[obj]).sphere.specular[2] = value[2];
+				if((*o).kind == 1){
+					(*o).sphere.specular[0] = value[0];
+					(*o).sphere.specular[1] = value[1];
+					(*o).sphere.specular[2] = value[2];
+				}
+				else if((*o).kind == 2){
+					(*o).plane.specular[0] = value[0];
+					(*o).plane.specular[1] = value[1];
+					(*o).plane.specular[2] = value[2];
 				}
-				else if((*object_array[obj]).kind == 2){
-					(*object_array[obj]).plane.specular[0] = value[0];
-					(*object_array[obj]).plane.specular[1] = value[1];
-					(*object_array[obj]).plane.specular[2] = value[2];
+				else if((*o).kind == 4){
+					(*o).mesh.specular[0] = value[0];
+					(*o).mesh.specular[1] = value[1];
+					(*o).mesh.specular[2] = value[2];
 				}
 			}
 			else if(strcmp(key, "direction") == 0) {
-				(*object_array[obj]).light.direction[0] = value[0];
-				(*object_array[obj]).light.direction[1] = value[1];
-				(*object_array[obj]).light.direction[2] = value[2];
+				(*o).light.direction[0] = value[0];
+				(*o).light.direction[1] = value[1];
+				(*o).light.direction[2] = value[2];
+			}
+		// MESH ONLY FIELDS, OTHER KINDS SHARE THE STORAGE
+	  } else if (strcmp(key, "scale") == 0 && (*o).kind == 4) {
+	    	double value = next_number(json);
+			if (value <= 0) {
+				parse_error("Error: Mesh scale must be positive on line %d.\n", line);
+			}
+			(*o).mesh.scale = value;
+	  } else if (strcmp(key, "rotation") == 0 && (*o).kind == 4) {
+	    	double* value = next_vector(json);
+			(*o).mesh.rotation[0] = value[0];
+			(*o).mesh.rotation[1] = value[1];
+			(*o).mesh.rotation[2] = value[2];
+		// BUILDING OBJECT STRING FIELDS
+	  } else if (strcmp(key, "file") == 0) {
+	    	char* value = next_string(json);
+			if ((*o).kind == 4) {
+				(*o).mesh.file = value;
+			}
+			else if ((*o).kind == 5) {
+				(*o).clusters.file = value;
 			}
 		// ERROR CHECK
 	  } else {
-	    fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
+	    parse_warning("Error: Unknown property, \"%s\", on line %d.\n",
 		    key, line);
 	    //char* value = next_string(json);
 	  }
 	  skip_ws(json);
 	} else {
-	  fprintf(stderr, "Error: Unexpected value on line %d\n", line);
-	  exit(1);
+	  parse_error("Error: Unexpected value on line %d\n", line);
 	}
-      }
-      skip_ws(json);
-      c = next_c(json);
-      if (c == ',') {
-		// noop
-		skip_ws(json);
-		} else if (c == ']') {
-		fclose(json);
-		object_array[obj] = NULL;
-		return;
-     } else {
-		fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
-		exit(1);
-     }
+  }
+}
+
+// SCENE CHUNK PARSED BY ONE THREAD
+typedef struct {
+  char* text;
+  long* starts;
+  int* lines;
+  int first;
+  int count;
+  Object* arena;
+  // warnings and the error that stopped the chunk, printed in file order
+  char* log;
+  size_t log_size;
+  int failed;
+} Chunk;
+
+// read_chunk() parses a run of consecutive objects into the chunk's own
+// arena. Every object is parsed from the line it starts on, so errors report
+// the same line numbers a serial parse would. Messages go to the chunk's log,
+// and the first error stops the chunk.
+void* read_chunk(void* arg) {
+  Chunk* chunk = arg;
+  long begin = chunk->starts[chunk->first];
+  long end = chunk->starts[chunk->first + chunk->count];
+  FILE* json = fmemopen(chunk->text + begin, end - begin, "r");
+  chunk->arena = calloc(chunk->count, sizeof(Object));
+  chunk->failed = 0;
+  parse_log = open_memstream(&chunk->log, &chunk->log_size);
+  jmp_buf abort_chunk;
+  parse_abort = &abort_chunk;
+  if (setjmp(abort_chunk) == 0) {
+    for (int i = 0; i < chunk->count; i++) {
+      int k = chunk->first + i;
+      fseek(json, chunk->starts[k] - begin, SEEK_SET);
+      line = chunk->lines[k];
+      expect_c(json, '{');
+      read_object(json, &chunk->arena[i]);
+    }
+  } else {
+    chunk->failed = 1;
+  }
+  fclose(parse_log);
+  parse_log = NULL;
+  parse_abort = NULL;
+  fclose(json);
+  return NULL;
+}
+
+// read_scene() loads a scene in three steps. The top level array is first
+// split at object boundaries in one quick pass that only looks for braces,
+// strings and separators. The objects are then divided into one chunk per
+// core and parsed concurrently, each chunk into its own arena. Last, the
+// objects are gathered into object_array in the order they appear in the file.
+void read_scene(char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+    exit(1);
+  }
+  struct stat st;
+  fstat(fd, &st);
+  long size = st.st_size;
+  char* text = NULL;
+  if (size > 0) {
+    text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+      fprintf(stderr, "Error: Could not read file \"%s\"\n", filename);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  // SPLITTING THE TOP LEVEL ARRAY
+  int count = 0;
+  int capacity = 1024;
+  long* starts = malloc((capacity + 1) * sizeof(long));
+  int* lines = malloc((capacity + 1) * sizeof(int));
+  long i = 0;
+  line = 1;
+  // an error found while splitting is only reported once the objects before
+  // it are parsed, since one of them may hold an earlier error
+  char split_error[256] = "";
+  while (i < size && isspace(text[i])) {
+    if (text[i++] == '\n') line++;
+  }
+  // Find the beginning of the list
+  if (i == size) {
+    fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+    exit(1);
+  }
+  if (text[i++] != '[') {
+    fprintf(stderr, "Error: Expected '[' on line %d.\n", line);
+    exit(1);
+  }
+  while (1) {
+    while (i < size && isspace(text[i])) {
+      if (text[i++] == '\n') line++;
     }
+    if (i == size) {
+      snprintf(split_error, sizeof(split_error), "Error: Unexpected end of file on line number %d.\n", line);
+      break;
+    }
+    if (count == 0 && text[i] == ']') {
+      fprintf(stderr, "Error: This is the worst scene file EVER.\n");
+      break;
+    }
+    if (text[i] != '{') {
+      snprintf(split_error, sizeof(split_error), "Error: Expected '{' on line %d.\n", line);
+      break;
+    }
+    if (count == capacity) {
+      capacity *= 2;
+      starts = realloc(starts, (capacity + 1) * sizeof(long));
+      lines = realloc(lines, (capacity + 1) * sizeof(int));
+    }
+    starts[count] = i;
+    lines[count] = line;
+    count++;
+    // objects hold no nested objects, so the first '}' outside a string
+    // closes this one
+    int in_string = 0;
+    while (i < size && (in_string || text[i] != '}')) {
+      if (text[i] == '"') in_string = !in_string;
+      if (text[i] == '\n') line++;
+      i++;
+    }
+    if (i == size) {
+      snprintf(split_error, sizeof(split_error), "Error: Unexpected end of file on line number %d.\n", line);
+      break;
+    }
+    i++;
+    while (i < size && isspace(text[i])) {
+      if (text[i++] == '\n') line++;
+    }
+    if (i < size && text[i] == ',') {
+      i++;
+    } else if (i < size && text[i] == ']') {
+      break;
+    } else {
+      snprintf(split_error, sizeof(split_error), "Error: Expecting ',' or ']' on line %d.\n", line);
+      break;
+    }
+  }
+  // the last chunk ends where the closing ']' starts
+  starts[count] = i;
+
+  // PARSING THE CHUNKS
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  // small scenes aren't worth a thread per core
+  if (threads > count / 256) threads = count / 256;
+  if (threads < 1) threads = 1;
+  Chunk* chunks = malloc(threads * sizeof(Chunk));
+  pthread_t* ids = malloc(threads * sizeof(pthread_t));
+  for (int t = 0; t < threads; t++) {
+    chunks[t].text = text;
+    chunks[t].starts = starts;
+    chunks[t].lines = lines;
+    chunks[t].first = (long) count * t / threads;
+    chunks[t].count = (long) count * (t + 1) / threads - chunks[t].first;
+  }
+  if (threads == 1) {
+    read_chunk(&chunks[0]);
+  } else {
+    for (int t = 0; t < threads; t++) {
+      pthread_create(&ids[t], NULL, read_chunk, &chunks[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+      pthread_join(ids[t], NULL);
+    }
+  }
+  // a serial parse would have stopped at the first error, so nothing after
+  // the first failed chunk is printed
+  for (int t = 0; t < threads; t++) {
+    fputs(chunks[t].log, stderr);
+    free(chunks[t].log);
+    if (chunks[t].failed) {
+      exit(1);
+    }
+  }
+  if (split_error[0] != '\0') {
+    fputs(split_error, stderr);
+    exit(1);
+  }
+
+  // MERGING IN INPUT ORDER
+  char* names[] = {"camera", "sphere", "plane", "light", "mesh", "clusters"};
+  object_array = malloc((count + 1) * sizeof(Object*));
+  obj = 0;
+  for (int t = 0; t < threads; t++) {
+    for (int k = 0; k < chunks[t].count; k++) {
+      object_array[obj] = &chunks[t].arena[k];
+      printf("Found %s\n", names[object_array[obj]->kind]);
+      obj++;
+    }
+  }
+  object_array[obj] = NULL;
+
+  free(chunks);
+  free(ids);
+  free(starts);
+  free(lines);
+  if (text != NULL) {
+    munmap(text, size);
   }
 }
@@ -1,13 +1,23 @@
 #include <stdio.h>
+#include <time.h>
+#include <limits.h>
 #include "parser.c"
+#include "mesh.c"
+#include "cluster.c"
+#include "encode.c"
 
 ///////////////////////////////////////////////////////////////
 // BEGINNING OF RAYCASTING FUNCTION
 ///////////////////////////////////////////////////////////////
 
-Object* lights[128];
+// LIGHTS FROM THE OBJECT ARRAY, ENDS WITH NULL
+Object** lights;
 int light = 0;
 
+// quality settings, lowered by the deadline mode when time runs short
+int max_depth = 7;
+int shadow_lights = INT_MAX;
+
 static inline double sqr(double v) {
 	return v*v;
 }
@@ -95,8 +105,36 @@ double clamp(double number){
 	}
 }
 
+void load_meshes(){
+	// loads the OBJ file behind every mesh object, instances share the data
+	for (int i = 0; object_array[i] != 0; i++) {
+		if (object_array[i]->kind == 4){
+			if (object_array[i]->mesh.file == NULL) {
+				fprintf(stderr, "Error: Mesh object has no \"file\".\n");
+				exit(1);
+			}
+			object_array[i]->mesh.data = load_mesh(object_array[i]->mesh.file);
+			rotation_matrix(object_array[i]->mesh.rotation, object_array[i]->mesh.matrix);
+		}
+	}
+}
+
+void load_clusters(){
+	// maps the cluster file behind every clusters object
+	for (int i = 0; object_array[i] != 0; i++) {
+		if (object_array[i]->kind == 5){
+			if (object_array[i]->clusters.file == NULL) {
+				fprintf(stderr, "Error: Clusters object has no \"file\".\n");
+				exit(1);
+			}
+			object_array[i]->clusters.data = open_clusters(object_array[i]->clusters.file);
+		}
+	}
+}
+
 void collect_lights(){
 	// loops through my object array and puts lights in special light array
+	lights = calloc(obj + 1, sizeof(Object*));
 	int i = 0;
 	for (i = 0; object_array[i] != 0; i++) {
 		if (object_array[i]->kind == 3){
@@ -132,22 +170,30 @@ double fradial(double a2, double a1, double a0, double d) {
 	}
 }
 
-double diffuse_l(double Kd, double Il, double* N, double* L) {
-	double dotResult = dot(N, L);
-	if (dotResult > 0) {
-		return Kd * Il * dotResult;
-	} else {
-		return 0;
+// fast_pow() raises x to a whole power by repeated squaring, a handful of
+// multiplies instead of the exp and log behind pow()
+static inline double fast_pow(double x, int n) {
+	double result = 1;
+	while (n > 0) {
+		if (n & 1) {
+			result *= x;
+		}
+		x *= x;
+		n >>= 1;
 	}
+	return result;
 }
 
-double specular_l(double Ks, double Il, double* V, double* R, double* N, double* L, double ns) {
-	double dotResult = dot(V, R);
-	if (dotResult > 0 && dot(N, L) > 0) {
-		return Ks * Il * pow(dotResult, ns);
-	} else {
-		return 0;
-	}
+// shade_light() works out the diffuse and specular light from one light for
+// all three channels at once. The geometric terms are found once, and the
+// channels, which only differ in material and light color, sit in the lanes
+// of one vector.
+static inline void shade_light(const vec4* Kd, const vec4* Ks, const vec4* Il, double atten, double* N, double* L, double* V, double* R, int ns, vec4* col) {
+	double NdotL = dot(N, L);
+	double VdotR = dot(V, R);
+	double diffuse = NdotL > 0 ? NdotL : 0;
+	double specular = (VdotR > 0 && NdotL > 0) ? fast_pow(VdotR, ns) : 0;
+	*col = atten * (*Kd * *Il * diffuse + *Ks * *Il * specular);
 }
 
 double cylinder_intersection(double* Ro, double* Rd,
@@ -248,35 +294,117 @@ double plane_intersection(double* Ro, double* Rd,
 }
 
 
-void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolor, int depth){
+///////////////////////////////////////////////////////////////
+// SCENE SPECIALIZED KERNELS
+///////////////////////////////////////////////////////////////
+
+// Features a scene may use. The tracing loop is compiled once for every
+// combination, and the one matching the scene is picked after loading, so
+// features the scene doesn't use cost nothing in the inner loops.
+#define FEATURE_SPOT 1
+#define FEATURE_FALLOFF 2
+#define FEATURE_REFLECT 4
+#define FEATURE_MESHES 8
+#define FEATURE_CLUSTERS 16
+#define KERNEL_COUNT 32
+
+typedef void (*Kernel)(Object** objects, double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolor, int depth);
+
+static const Kernel kernels[KERNEL_COUNT];
+
+// scene_features() finds the features used by the loaded scene
+int scene_features() {
+	int features = 0;
+	for (int i = 0; lights[i] != NULL; i++) {
+		if (lights[i]->light.angular != INFINITY && lights[i]->light.theta != 0) {
+			features |= FEATURE_SPOT;
+		}
+		if (lights[i]->light.radial[0] != INFINITY) {
+			features |= FEATURE_FALLOFF;
+		}
+	}
+	for (int i = 0; object_array[i] != NULL; i++) {
+		switch (object_array[i]->kind) {
+			case 1:
+				if (object_array[i]->sphere.reflectivity > 0) {
+					features |= FEATURE_REFLECT;
+				}
+				break;
+			case 4:
+				features |= FEATURE_MESHES;
+				if (object_array[i]->mesh.reflectivity > 0) {
+					features |= FEATURE_REFLECT;
+				}
+				break;
+			case 5:
+				// streamed spheres aren't looked at ahead of time, any of
+				// them may reflect
+				features |= FEATURE_CLUSTERS | FEATURE_REFLECT;
+				break;
+		}
+	}
+	return features;
+}
+
+// trace() traces a ray against the objects in the NULL terminated list
+// objects and stores its color in ocolor. Primary rays pass the list for
+// their screen tile, all other rays the whole scene. Shadow rays always test
+// the whole scene. features is a constant in every kernel, so the tests on
+// it are resolved at compile time.
+static inline __attribute__((always_inline)) void trace(Object** objects, double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolor, int depth, const int features){
 	
 	double color[3] = {0,0,0};
-	int best;
+	int best = 0;
 	double best_t = INFINITY;
-	for (int i=0; object_array[i] != 0; i++) {
-		if (object_array[i] == obj){
+	// normal of the closest mesh triangle, meshes can't recompute it later
+	double best_N[3] = {0, 0, 0};
+	double mesh_N[3];
+	// copy of the closest streamed sphere, it has no object of its own
+	Object streamed;
+	Object candidate;
+	for (int i=0; objects[i] != 0; i++) {
+		// a convex object can't be hit again by a ray leaving it, a mesh
+		// may be concave and relies on its distance epsilon instead
+		if (objects[i] == obj && obj->kind != 4){
 			continue;
 		}
 		double t = 0;
-		switch(object_array[i]->kind) {
+		switch(objects[i]->kind) {
 			case 0:
 				// pass, its a camera
 				break;
 			case 1:
 				// CHECK INTERSECTION FOR SPHERE
 				t = sphere_intersection(Ro, Rd,
-						object_array[i]->sphere.position,
-						object_array[i]->sphere.radius);
+						objects[i]->sphere.position,
+						objects[i]->sphere.radius);
 				break;
 			case 2:
 				// CHECK INTERSECTION FOR PLANE
 				t = plane_intersection(Ro, Rd,
-					object_array[i]->plane.position,
-					object_array[i]->plane.normal);
+					objects[i]->plane.position,
+					objects[i]->plane.normal);
 				break;
 			case 3:
 				// pass, its a light
 				break;
+			case 4:
+				// CHECK INTERSECTION FOR MESH
+				if (features & FEATURE_MESHES) {
+					t = mesh_intersection(Ro, Rd,
+						objects[i]->mesh.position,
+						objects[i]->mesh.scale,
+						objects[i]->mesh.matrix,
+						objects[i]->mesh.data, mesh_N);
+				}
+				break;
+			case 5:
+				// CHECK INTERSECTION FOR STREAMED SPHERES
+				if (features & FEATURE_CLUSTERS) {
+					t = clusters_intersection(Ro, Rd,
+						objects[i]->clusters.data, &candidate);
+				}
+				break;
 			default:
 				// Horrible error
 				exit(1);
@@ -284,8 +412,21 @@ void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolo
 		if (t > 0 && t < best_t) {
 			best_t = t;
 			best = i;	
+			if ((features & FEATURE_MESHES) && objects[i]->kind == 4) {
+				best_N[0] = mesh_N[0];
+				best_N[1] = mesh_N[1];
+				best_N[2] = mesh_N[2];
+			}
+			if ((features & FEATURE_CLUSTERS) && objects[i]->kind == 5) {
+				streamed = candidate;
+			}
 		}
 	}
+	// the object that was hit, streamed spheres are shaded from their copy
+	Object* hit = NULL;
+	if (best_t != INFINITY) {
+		hit = (features & FEATURE_CLUSTERS) && objects[best]->kind == 5 ? &streamed : objects[best];
+	}
 	double Ron[3] = {
 		best_t * Rd[0] + Ro[0],
 		best_t * Rd[1] + Ro[1],
@@ -294,6 +435,74 @@ void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolo
 	int closest_shadow_object;
 	// shadow test loop, doesnt work
 	if (best_t > 0 && best_t != INFINITY) {
+		// same variable setting for light equation from project 3, none of
+		// it depends on the light
+		double N[3] = {0, 0, 0};
+		vec4 Kd = {0, 0, 0, 0};
+		vec4 Ks = {0, 0, 0, 0};
+		double reflectivity = 0;
+		if (hit->kind == 1){
+			N[0] = Ron[0] - hit->sphere.position[0];
+			N[1] = Ron[1] - hit->sphere.position[1];
+			N[2] = Ron[2] - hit->sphere.position[2];
+			Kd = (vec4) {hit->sphere.diffuse[0], hit->sphere.diffuse[1], hit->sphere.diffuse[2], 0};
+			Ks = (vec4) {hit->sphere.specular[0], hit->sphere.specular[1], hit->sphere.specular[2], 0};
+			reflectivity = hit->sphere.reflectivity;
+		}
+		else if (hit->kind == 2){
+			N[0] = hit->plane.normal[0];
+			N[1] = hit->plane.normal[1];
+			N[2] = hit->plane.normal[2];
+			Kd = (vec4) {hit->plane.diffuse[0], hit->plane.diffuse[1], hit->plane.diffuse[2], 0};
+			Ks = (vec4) {hit->plane.specular[0], hit->plane.specular[1], hit->plane.specular[2], 0};
+			reflectivity = hit->plane.reflectivity;
+		}
+		else if ((features & FEATURE_MESHES) && hit->kind == 4){
+			N[0] = best_N[0];
+			N[1] = best_N[1];
+			N[2] = best_N[2];
+			Kd = (vec4) {hit->mesh.diffuse[0], hit->mesh.diffuse[1], hit->mesh.diffuse[2], 0};
+			Ks = (vec4) {hit->mesh.specular[0], hit->mesh.specular[1], hit->mesh.specular[2], 0};
+			reflectivity = hit->mesh.reflectivity;
+		}
+		normalize(N);
+		// vector from camera
+		double V[3] = {Rdc[0], Rdc[1], Rdc[2]};
+
+		// REFLECTING THINGS
+		// the reflected color doesn't depend on the light either, so it is
+		// traced once here and added after every light below
+		double reflected[3] = {0,0,0};
+		if ((features & FEATURE_REFLECT) && depth < max_depth && lights[0] != NULL){
+			double N[3] = {0, 0, 0};
+			// setting new normal vector to find reflected vector
+			if (hit->kind == 1){
+				N[0] = Ron[0] - hit->sphere.position[0];
+				N[1] = Ron[1] - hit->sphere.position[1];
+				N[2] = Ron[2] - hit->sphere.position[2];
+			}
+			else if (hit->kind == 2){
+				N[0] = Ron[0] - hit->plane.normal[0];
+				N[1] = Ron[1] - hit->plane.normal[1];
+				N[2] = Ron[2] - hit->plane.normal[2];
+			}
+			else if ((features & FEATURE_MESHES) && hit->kind == 4){
+				N[0] = best_N[0];
+				N[1] = best_N[1];
+				N[2] = best_N[2];
+			}
+			normalize(N);
+			double Rdn[3];
+			// planes don't trace reflections
+			if ((hit->kind == 1 || hit->kind == 4) && reflectivity > 0){
+				// find reflected vector, then normalize
+				reflect(Rd, N, Rdn);
+				normalize(Rdn);
+				// recursive call
+				kernels[features](object_array, Ron, Rdn, Rdc, hit, reflected, depth + 1);
+			}
+		}
+
 		for (int i = 0; lights[i] != NULL; i++){
 			double Rdn[3] = {
 				lights[i]->light.position[0] - Ron[0],
@@ -301,11 +510,11 @@ void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolo
 				lights[i]->light.position[2] - Ron[2]
 				};
 			normalize(Rdn);
-			int t = 0;
 			closest_shadow_object = 0;
-			for (int j = 0; object_array[j] != 0; j++){
+			// lights past shadow_lights are shaded without a shadow test
+			for (int j = 0; i < shadow_lights && object_array[j] != 0; j++){
 				double t = 0;
-				if (object_array[j] == object_array[best]){
+				if (object_array[j] == hit && hit->kind != 4){
 					continue;
 				}
 				switch(object_array[j]->kind) {
@@ -327,6 +536,23 @@ void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolo
 					case 3:
 						// pass, its a light
 						break;
+					case 4:
+						// CHECK INTERSECTION FOR MESH
+						if (features & FEATURE_MESHES) {
+							t = mesh_intersection(Ron, Rdn,
+								object_array[j]->mesh.position,
+								object_array[j]->mesh.scale,
+								object_array[j]->mesh.matrix,
+								object_array[j]->mesh.data, mesh_N);
+						}
+						break;
+					case 5:
+						// CHECK INTERSECTION FOR STREAMED SPHERES
+						if (features & FEATURE_CLUSTERS) {
+							t = clusters_intersection(Ron, Rdn,
+								object_array[j]->clusters.data, &candidate);
+						}
+						break;
 					default:
 						// Horrible error
 						exit(1);
@@ -337,31 +563,12 @@ void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolo
 				}
 			}
 			if (closest_shadow_object == 0){
-				// HOLDER VARIABLE FOR CLOSEST OBJECTS COLOR
-				color[0] = 0;
-				color[1] = 0;
-				color[2] = 0;
-				// same variable setting for light equation from project 3
-				double N[3];
-				if (object_array[best]->kind == 1){
-					N[0] = Ron[0] - object_array[best]->sphere.position[0];
-					N[1] = Ron[1] - object_array[best]->sphere.position[1];
-					N[2] = Ron[2] - object_array[best]->sphere.position[2];
-				}
-				else if (object_array[best]->kind == 2){
-					N[0] = object_array[best]->plane.normal[0];
-					N[1] = object_array[best]->plane.normal[1];
-					N[2] = object_array[best]->plane.normal[2];
-				}
-				normalize(N);
 				double L[3] = {Rdn[0], Rdn[1], Rdn[2]};
 				normalize(L);
 				double nL[3] = {-L[0], -L[1], -L[2]};
 				// reflected vector
 				double R[3];
 				reflect(L, N, R);
-				// vector from camera
-				double V[3] = {Rdc[0], Rdc[1], Rdc[2]};
 				// position vector of light
 				double pos[3] = {lights[i]->light.position[0],
 					lights[i]->light.position[1],
@@ -369,72 +576,29 @@ void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolo
 				// finding distance of light from object
 				subtract(pos, Ron);
 				double d = magnitude(pos);
-				double col;
-				// finds color using lighting equations from previous project
+				// attenuation is the same for every channel
+				double atten = 1;
+				if ((features & FEATURE_SPOT) && lights[i]->light.angular != INFINITY && lights[i]->light.theta != 0) {
+					atten *= fangular(nL, lights[i]->light.direction, lights[i]->light.angular, (lights[i]->light.theta)*0.0174533);
+				}
+				if ((features & FEATURE_FALLOFF) && lights[i]->light.radial[0] != INFINITY) {
+					atten *= fradial(lights[i]->light.radial[2], lights[i]->light.radial[1], lights[i]->light.radial[0], d);
+				}
+				vec4 Il = {lights[i]->light.color[0], lights[i]->light.color[1], lights[i]->light.color[2], 0};
+				// finds color using lighting equations from previous project,
+				// each light that reaches the point replaces the color
+				vec4 col;
+				shade_light(&Kd, &Ks, &Il, atten, N, L, V, R, 20, &col);
 				for (int c = 0; c < 3; c++) {
-					 col = 1;
-					 if (lights[i]->light.angular != INFINITY && lights[i]->light.theta != 0) {
-						col *= fangular(nL, lights[i]->light.direction, lights[i]->light.angular, (lights[i]->light.theta)*0.0174533);
-					 }
-					 if (lights[i]->light.radial[0] != INFINITY) {
-						col *= fradial(lights[i]->light.radial[2], lights[i]->light.radial[1], lights[i]->light.radial[0], d);
-					 }
-					 if (object_array[best]->kind == 1){
-						col *= (diffuse_l(object_array[best]->sphere.diffuse[c], lights[i]->light.color[c], N, L) + (specular_l(object_array[best]->sphere.specular[c], lights[i]->light.color[c], V, R, N, L, 20)));
-						color[c] += col;
-					 }
-					 else if (object_array[best]->kind == 2){
-						col *= (diffuse_l(object_array[best]->plane.diffuse[c], lights[i]->light.color[c], N, L) + (specular_l(object_array[best]->plane.specular[c], lights[i]->light.color[c], V, R, N, L, 20)));
-						color[c] += col;
-					 }
 					 // makes sure colors are in correct range
-					 color[c] = clamp(color[c]);
+					 color[c] = clamp(col[c]);
 				}
 			}
-			// base case, only allowing a depth of 7 reflections
-			if (depth < 7){
-				double N[3];
-				// setting new normal vector to find reflected vector
-				if (object_array[best]->kind == 1){
-					N[0] = Ron[0] - object_array[best]->sphere.position[0];
-					N[1] = Ron[1] - object_array[best]->sphere.position[1];
-					N[2] = Ron[2] - object_array[best]->sphere.position[2];
-				}
-				else if (object_array[best]->kind == 2){
-					N[0] = Ron[0] - object_array[best]->plane.normal[0];
-					N[1] = Ron[1] - object_array[best]->plane.normal[1];
-					N[2] = Ron[2] - object_array[best]->plane.normal[2];
-				}
-				normalize(N);
-				double Rdn[3];
-				// REFLECTING THINGS
-				double reflected[3];
-				if (object_array[best]->kind == 1){
-					if (object_array[best]->sphere.reflectivity > 0){
-						// find reflected vector, then normalize
-						reflect(Rd, N, Rdn);
-						normalize(Rdn);
-						// recursive call
-						reflections(Ron, Rdn, Rdc, object_array[best], reflected, depth++);
-					}
-				}
-				else if (object_array[best]->kind == 1){
-					if (object_array[best]->plane.reflectivity > 0){
-						// find reflected vector, then normalize
-						reflect(Rd, N, Rdn);
-						normalize(Rdn);
-						// recursive call
-						reflections(Ron, Rdn, Rdc, object_array[best], reflected, depth++);
-					}
-				}
+			// base case, only allowing max_depth reflections (7 by default)
+			if ((features & FEATURE_REFLECT) && depth < max_depth){
 				for (int i = 0; i < 3; i++){
 					// add reflected color to the current color
-					if (object_array[best]->kind == 1){
-						color[i] += object_array[best]->sphere.reflectivity * reflected[i];
-					}
-					if (object_array[best]->kind == 2){
-						color[i] += object_array[best]->plane.reflectivity * reflected[i];
-					}
+					color[i] += reflectivity * reflected[i];
 				}
 			}
 		}
@@ -445,68 +609,635 @@ void reflections(double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolo
 	ocolor[2] = color[2];
 }
 
-int main(int argc, char **argv) {
+// one kernel per combination of features
+#define KERNELS(X) \
+	X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+	X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) \
+	X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) \
+	X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+
+#define KERNEL(features) \
+	static void trace_##features(Object** objects, double* Ro, double* Rd, double* Rdc, Object* obj, double* ocolor, int depth) { \
+		trace(objects, Ro, Rd, Rdc, obj, ocolor, depth, features); \
+	}
+KERNELS(KERNEL)
+#undef KERNEL
+
+#define KERNEL(features) trace_##features,
+static const Kernel kernels[KERNEL_COUNT] = { KERNELS(KERNEL) };
+#undef KERNEL
+
+// reflections() traces a ray through the scene, set by main() to the kernel
+// for the loaded scene
+Kernel reflections = trace_31;
+
+///////////////////////////////////////////////////////////////
+// IMAGE OUTPUT
+///////////////////////////////////////////////////////////////
+
+// framebuffer the pixels are traced into before being written out
+Pixel* image;
+int image_width;
+int image_height;
+
+// view plane size, taken from the camera object
+double view_width;
+double view_height;
+
+///////////////////////////////////////////////////////////////
+// SCREEN SPACE BINNING
+///////////////////////////////////////////////////////////////
+
+// The image is split into square tiles and every object is listed in the
+// tiles its projection onto the view plane touches, so primary rays only
+// test the objects that can be under their pixel.
+#define TILE_SIZE 16
+
+int tiles_x;
+int tiles_y;
+// one NULL terminated object list per tile, all kept in one block
+Object*** tiles;
+
+// tile_objects() returns the objects the primary ray for column x of image
+// row row can hit
+static inline Object** tile_objects(int x, int row) {
+	return tiles[(row / TILE_SIZE) * tiles_x + x / TILE_SIZE];
+}
+
+// pixel_clamp() keeps a pixel coordinate just outside the image, so bounds
+// far off screen don't overflow an int
+static inline double pixel_clamp(double p, int size) {
+	if (p < -1) return -1;
+	if (p > size) return size;
+	return p;
+}
+
+// screen_bounds() projects the box from min to max onto the view plane and
+// stores the tiles it touches in range as first and last tile column, then
+// first and last tile row. Returns 0 if the box reaches behind the camera,
+// where it can't be projected.
+int screen_bounds(double* min, double* max, int* range) {
+	if (min[2] <= 1e-6) {
+		return 0;
+	}
+	double umin = INFINITY;
+	double umax = -INFINITY;
+	double vmin = INFINITY;
+	double vmax = -INFINITY;
+	// the box is convex and in front of the camera, so its projection lies
+	// inside the projection of its corners
+	for (int corner = 0; corner < 8; corner++) {
+		double z = corner & 4 ? max[2] : min[2];
+		double u = (corner & 1 ? max[0] : min[0]) / z;
+		double v = (corner & 2 ? max[1] : min[1]) / z;
+		umin = fmin(umin, u);
+		umax = fmax(umax, u);
+		vmin = fmin(vmin, v);
+		vmax = fmax(vmax, v);
+	}
+	double pixwidth = view_width / image_width;
+	double pixheight = view_height / image_height;
+	// inverse of the ray setup in trace_pixel(), with a pixel to spare on
+	// every side for rounding
+	int x0 = pixel_clamp(floor((umin + view_width/2) / pixwidth - 0.5) - 1, image_width);
+	int x1 = pixel_clamp(ceil((umax + view_width/2) / pixwidth - 0.5) + 1, image_width);
+	// rows are stored top down, so the top of the box gives the first row
+	int row0 = pixel_clamp(image_height - ceil((vmax + view_height/2) / pixheight - 0.5) - 1, image_height);
+	int row1 = pixel_clamp(image_height - floor((vmin + view_height/2) / pixheight - 0.5) + 1, image_height);
+	if (x1 < 0 || x0 >= image_width || row1 < 0 || row0 >= image_height) {
+		// off screen, the range is left empty
+		range[0] = 0;
+		range[1] = -1;
+		range[2] = 0;
+		range[3] = -1;
+		return 1;
+	}
+	range[0] = (x0 < 0 ? 0 : x0) / TILE_SIZE;
+	range[1] = (x1 >= image_width ? image_width - 1 : x1) / TILE_SIZE;
+	range[2] = (row0 < 0 ? 0 : row0) / TILE_SIZE;
+	range[3] = (row1 >= image_height ? image_height - 1 : row1) / TILE_SIZE;
+	return 1;
+}
+
+// plane_in_tile() checks whether any primary ray of tile tx, ty can hit a
+// plane. A ray from the camera hits the plane when N dot Rd has the same sign
+// as N dot C, and N dot Rd is linear across the tile, so checking the
+// corners, padded by a pixel, is enough.
+int plane_in_tile(Object* plane, int tx, int ty) {
+	double* N = plane->plane.normal;
+	double* C = plane->plane.position;
+	double side = N[0]*C[0] + N[1]*C[1] + N[2]*C[2];
+	double pixwidth = view_width / image_width;
+	double pixheight = view_height / image_height;
+	double x0 = tx * TILE_SIZE - 1;
+	double x1 = (tx + 1) * TILE_SIZE;
+	double y0 = image_height - (ty + 1) * TILE_SIZE;
+	double y1 = image_height - ty * TILE_SIZE + 1;
+	for (int corner = 0; corner < 4; corner++) {
+		double u = -(view_width/2) + pixwidth * ((corner & 1 ? x1 : x0) + 0.5);
+		double v = -(view_height/2) + pixheight * ((corner & 2 ? y1 : y0) + 0.5);
+		if (side * (N[0]*u + N[1]*v + N[2]) > 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// object_tiles() finds the tiles object o can be seen in and stores them in
+// range like screen_bounds(). Returns 0 if primary rays never hit it.
+int object_tiles(Object* o, int* range) {
+	double min[3];
+	double max[3];
+	int bounded = 0;
+	if (o->kind == 1) {
+		for (int k = 0; k < 3; k++) {
+			min[k] = o->sphere.position[k] - o->sphere.radius;
+			max[k] = o->sphere.position[k] + o->sphere.radius;
+		}
+		bounded = 1;
+	} else if (o->kind == 4) {
+		// mesh bounds are in its own space, so the box around the
+		// rotated, scaled and moved corners is used
+		double* R = o->mesh.matrix;
+		Mesh* mesh = o->mesh.data;
+		for (int k = 0; k < 3; k++) {
+			min[k] = INFINITY;
+			max[k] = -INFINITY;
+		}
+		for (int corner = 0; corner < 8; corner++) {
+			double c[3] = {
+				corner & 1 ? mesh->max[0] : mesh->min[0],
+				corner & 2 ? mesh->max[1] : mesh->min[1],
+				corner & 4 ? mesh->max[2] : mesh->min[2]
+			};
+			for (int k = 0; k < 3; k++) {
+				double p = o->mesh.position[k] + o->mesh.scale * (R[k*3]*c[0] + R[k*3 + 1]*c[1] + R[k*3 + 2]*c[2]);
+				min[k] = fmin(min[k], p);
+				max[k] = fmax(max[k], p);
+			}
+		}
+		bounded = 1;
+	} else if (o->kind == 5) {
+		// streamed spheres are only found inside the grid
+		for (int k = 0; k < 3; k++) {
+			min[k] = o->clusters.data->header.min[k];
+			max[k] = o->clusters.data->header.max[k];
+		}
+		bounded = 1;
+	} else if (o->kind != 2) {
+		// cameras and lights are never hit
+		return 0;
+	}
+	if (!bounded || !screen_bounds(min, max, range)) {
+		// planes, and boxes reaching behind the camera, cover every tile
+		range[0] = 0;
+		range[1] = tiles_x - 1;
+		range[2] = 0;
+		range[3] = tiles_y - 1;
+	}
+	return 1;
+}
+
+// bin_objects() builds the object list of every tile. Lists keep the scene
+// order, so ties between objects resolve the same as without binning.
+void bin_objects() {
+	tiles_x = (image_width + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (image_height + TILE_SIZE - 1) / TILE_SIZE;
+	int tile_count = tiles_x * tiles_y;
+	int* counts = calloc(tile_count, sizeof(int));
+	Object** lists = NULL;
+	tiles = NULL;
+	// the first pass counts the objects in each tile, the second fills the
+	// lists in
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; object_array[i] != NULL; i++) {
+			int range[4];
+			if (!object_tiles(object_array[i], range)) {
+				continue;
+			}
+			for (int ty = range[2]; ty <= range[3]; ty++) {
+				for (int tx = range[0]; tx <= range[1]; tx++) {
+					if (object_array[i]->kind == 2 && !plane_in_tile(object_array[i], tx, ty)) {
+						continue;
+					}
+					int t = ty * tiles_x + tx;
+					if (pass == 0) {
+						counts[t]++;
+					} else {
+						tiles[t][counts[t]++] = object_array[i];
+					}
+				}
+			}
+		}
+		if (pass == 0) {
+			size_t total = 0;
+			for (int t = 0; t < tile_count; t++) {
+				total += counts[t] + 1;
+			}
+			// zeroed, so every list ends in NULL
+			lists = calloc(total, sizeof(Object*));
+			tiles = malloc(tile_count * sizeof(Object**));
+			if (lists == NULL || tiles == NULL) {
+				fprintf(stderr, "Error: Out of memory binning objects.\n");
+				exit(1);
+			}
+			size_t offset = 0;
+			for (int t = 0; t < tile_count; t++) {
+				tiles[t] = lists + offset;
+				offset += counts[t] + 1;
+				counts[t] = 0;
+			}
+		}
+	}
+	free(counts);
+}
+
+// trace_pixel() shoots the primary ray for column x of image row row and
+// returns the resulting color
+Pixel trace_pixel(int x, int row) {
+	// camera position
+	double cx = 0;
+	double cy = 0;
+	double pixheight = view_height / image_height;
+	double pixwidth = view_width / image_width;
+	// rows are stored top down, so the y component is flipped
+	int y = image_height - row;
+	double color[3] = {0,0,0};
+	double Ro[3] = {0, 0, 0};
+	double Rd[3] = {
+		cx - (view_width/2) + pixwidth * (x + 0.5),
+		cy - (view_height/2) + pixheight * (y + 0.5),
+		1
+	};
+	normalize(Rd);
+	// first recursive call, which will return a color vector for that pixel
+	reflections(tile_objects(x, row), Ro, Rd, Rd, NULL, color, 0);
+	// SETTING PIXELS COLOR TO CLOSEST OBJECTS COLOR
+	Pixel new;
+	new.red = color[0];
+	new.green = color[1];
+	new.blue = color[2];
+	return new;
+}
+
+// open_output() opens a temporary file next to filename. The frame is
+// written there and renamed into place by close_output(), so a viewer
+// watching the output never sees a half written frame. Only a regular file,
+// or a name with nothing there yet, is replaced that way. Anything else, like
+// a pipe, a FIFO, a symlink or /dev/stdout, is written directly, as is a file
+// in a directory the temporary file can't be made in. tmpname is left empty
+// when writing directly.
+FILE* open_output(char* filename, char* tmpname, int size) {
+	struct stat st;
+	FILE* output = NULL;
+	if (lstat(filename, &st) != 0 || S_ISREG(st.st_mode)) {
+		snprintf(tmpname, size, "%s.tmp", filename);
+		output = fopen(tmpname, "wb+");
+	}
+	if (output == NULL) {
+		tmpname[0] = '\0';
+		output = fopen(filename, "wb");
+	}
+	if (output == NULL) {
+		fprintf(stderr, "Error: Could not open output file \"%s\"\n", filename);
+		exit(1);
+	}
+	return output;
+}
 
-	// OPEN FILE
-	FILE* output;
-	output = fopen(argv[4], "wb+");
-	// I SHOULD ERROR CHECK HERE FOR THE CORRECT TYPE OF OUTPUT FILE, BUT I'M OUT OF TIME
+void close_output(FILE* output, char* filename, char* tmpname) {
+	if (fclose(output) != 0 || (tmpname[0] != '\0' && rename(tmpname, filename) != 0)) {
+		fprintf(stderr, "Error: Could not write output file \"%s\"\n", filename);
+		exit(1);
+	}
+}
+
+// write_ppm() writes the whole framebuffer to filename as a P3 image
+void write_ppm(char* filename) {
+	char tmpname[1024];
+	FILE* output = open_output(filename, tmpname, sizeof(tmpname));
 	// WRITING HEADER INFO
 	fprintf(output, "P3\n");
-	fprintf(output, "%d %d\n%d\n", atoi(argv[1]), atoi(argv[2]), 255);
+	fprintf(output, "%d %d\n%d\n", image_width, image_height, 255);
+	for (int i = 0; i < image_width * image_height; i++) {
+		fprintf(output, "%i %i %i ", image[i].red, image[i].green, image[i].blue);
+	}
+	close_output(output, filename, tmpname);
+}
+
+// write_image() writes the whole framebuffer in the format the file
+// extension asks for, PNG, QOI or else PPM
+void write_image(char* filename) {
+	int format = output_format(filename);
+	if (format == FORMAT_PPM) {
+		write_ppm(filename);
+		return;
+	}
+	char tmpname[1024];
+	FILE* output = open_output(filename, tmpname, sizeof(tmpname));
+	Encoder encoder;
+	start_encoder(&encoder, format, image, image_width, image_height);
+	finish_encoder(&encoder, output);
+	close_output(output, filename, tmpname);
+}
+
+double elapsed_ms(struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// render_pass() traces the pixels that are new at the given block size and
+// fills the rest of each block with their color. One ray per 8x8 block is
+// the coarsest pass, later passes skip the corners an earlier pass sampled.
+// Blocks are visited in raster order starting at *done, which counts the
+// finished blocks, so a pass that was stopped can be picked up again. If
+// deadline is positive the pass gives up once that many milliseconds have
+// gone by since start and returns 0, leaving the unfinished blocks upscaled.
+int render_pass(int block, long* done, struct timespec* start, double deadline) {
+	long cols = (image_width + block - 1) / block;
+	long blocks = cols * ((image_height + block - 1) / block);
+	for (; *done < blocks; (*done)++) {
+		if (deadline > 0 && elapsed_ms(start) > deadline) {
+			return 0;
+		}
+		int row = *done / cols * block;
+		int x = *done % cols * block;
+		// corners of the coarser grid were traced by the last pass
+		if (block < 8 && row % (block*2) == 0 && x % (block*2) == 0) {
+			continue;
+		}
+		Pixel sample = trace_pixel(x, row);
+		// upscale the sample over its block
+		for (int by = row; by < row + block && by < image_height; by++) {
+			for (int bx = x; bx < x + block && bx < image_width; bx++) {
+				image[by * image_width + bx] = sample;
+			}
+		}
+	}
+	return 1;
+}
+
+// pass_rays() counts the rays render_pass() traces at the given block size
+double pass_rays(int block) {
+	double cols = (image_width + block - 1) / block;
+	double rows = (image_height + block - 1) / block;
+	if (block < 8) {
+		double coarse_cols = (image_width + block*2 - 1) / (block*2);
+		double coarse_rows = (image_height + block*2 - 1) / (block*2);
+		return cols * rows - coarse_cols * coarse_rows;
+	}
+	return cols * rows;
+}
+
+// render_progressive() renders the image in passes of shrinking block size
+// and writes a frame after every pass, so a usable preview is on disk long
+// before the full image is done.
+void render_progressive(char* filename) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int block = 8; block >= 1; block /= 2) {
+		long done = 0;
+		render_pass(block, &done, &start, 0);
+		write_image(filename);
+		printf("Pass with %dx%d blocks written after %.1f ms.\n", block, block, elapsed_ms(&start));
+	}
+}
+
+// probe_cost() measures the current cost of a primary ray in milliseconds by
+// tracing a sparse grid of pixels spread over the whole image. It stops early
+// once limit milliseconds are spent, so a slow scene can't eat the budget.
+double probe_cost(double limit) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int rays = 0;
+	for (int py = 0; py < 4; py++) {
+		for (int px = 0; px < 4; px++) {
+			trace_pixel((2*px + 1) * image_width / 8, (2*py + 1) * image_height / 8);
+			rays++;
+			if (elapsed_ms(&start) > limit) {
+				return elapsed_ms(&start) / rays;
+			}
+		}
+	}
+	return elapsed_ms(&start) / rays;
+}
+
+// render_deadline() delivers a frame within budget milliseconds of start. The
+// cost of a ray is probed up front and then taken from every finished pass. If
+// the next pass would not fit in the time left, the reflection depth is
+// lowered first, then the number of lights that get a shadow test, with the
+// estimate scaled down for the work each step drops. The coarse pass can't be
+// skipped, so its cost is probed again after every round of reductions rather
+// than trusting the scaled guess. If a finer pass still does not fit,
+// refinement stops and the image keeps the coarser sampling. The coarse frame
+// is written out right away so there is a frame on disk whatever happens; if
+// even the coarse pass runs out of time, its remaining blocks are traced
+// without reflections or shadows past the deadline. Every reduction is
+// reported at the end.
+void render_deadline(char* filename, double budget, struct timespec* start) {
+	if (shadow_lights > light) {
+		shadow_lights = light;
+	}
+	// lowering the depth buys nothing in a scene without mirrors
+	int reflective = scene_features() & FEATURE_REFLECT;
+	int full_depth = max_depth;
+	int full_lights = shadow_lights;
+
+	// time needed for the final write, a guess until the coarse frame has
+	// been written
+	double reserve = budget / 10;
+	// block size of the last finished pass, 16 until the coarse pass is done
+	int block = 16;
+	int cut_short = 0;
+	int coarse_late = 0;
+	double cost = probe_cost(budget / 20);
+	while (block > 1) {
+		int next = block / 2;
+		double rays = pass_rays(next);
+		int depth_before = max_depth;
+		int lights_before = shadow_lights;
+		double remaining = budget - reserve - elapsed_ms(start);
+		double estimate = cost;
+		while (rays * estimate > remaining && ((reflective && max_depth > 0) || shadow_lights > 0)) {
+			// a ray costs about one trace per reflection level and one
+			// shadow test per light
+			while (rays * estimate > remaining && ((reflective && max_depth > 0) || shadow_lights > 0)) {
+				if (reflective && max_depth > 0) {
+					estimate *= (max_depth / 2 + 1.0) / (max_depth + 1.0);
+					max_depth /= 2;
+				} else {
+					estimate *= (shadow_lights / 2 + 1.0) / (shadow_lights + 1.0);
+					shadow_lights /= 2;
+				}
+			}
+			if (next == 8) {
+				estimate = probe_cost(budget / 20);
+				remaining = budget - reserve - elapsed_ms(start);
+			}
+		}
+		if (rays * estimate > remaining && next < 8) {
+			// no pass is rendered with these settings, so don't report them
+			max_depth = depth_before;
+			shadow_lights = lights_before;
+			break;
+		}
+		double pass_start = elapsed_ms(start);
+		long done = 0;
+		if (!render_pass(next, &done, start, budget - reserve)) {
+			if (next < 8) {
+				cut_short = 1;
+				break;
+			}
+			// a partial coarse frame is useless, finish it as cheaply as
+			// possible
+			coarse_late = 1;
+			if (reflective) {
+				max_depth = 0;
+			}
+			shadow_lights = 0;
+			render_pass(next, &done, start, 0);
+			block = next;
+			break;
+		}
+		cost = (elapsed_ms(start) - pass_start) / rays;
+		if (next == 8) {
+			double before_write = elapsed_ms(start);
+			write_image(filename);
+			// leave some slack, the final write won't take exactly as long
+			reserve = (elapsed_ms(start) - before_write) * 1.25 + budget / 100;
+		}
+		block = next;
+	}
+	// the coarse frame is already on disk if nothing was refined
+	if (block < 8 || cut_short || coarse_late) {
+		write_image(filename);
+	}
+
+	double total = elapsed_ms(start);
+	printf("Frame written after %.1f ms of a %.1f ms budget.\n", total, budget);
+	if (total > budget) {
+		printf("Deadline missed by %.1f ms.\n", total - budget);
+	}
+	if (max_depth < full_depth) {
+		printf("Reduced reflection depth from %d to %d.\n", full_depth, max_depth);
+	}
+	if (shadow_lights < full_lights) {
+		printf("Shadow tested %d of %d lights.\n", shadow_lights, full_lights);
+	}
+	if (coarse_late) {
+		printf("Coarse pass ran out of time, the rest of it was traced at the lowest quality.\n");
+	} else if (cut_short) {
+		printf("Reduced sampling to one ray per %dx%d block, finer pass partially done.\n", block, block);
+	} else if (block > 1) {
+		printf("Reduced sampling to one ray per %dx%d block.\n", block, block);
+	}
+}
+
+void usage() {
+	fprintf(stderr, "Usage: raytrace [--progressive] [--deadline-ms <ms>] [--cache-mb <mb>] <width> <height> input.json output.(ppm|png|qoi)\n");
+	fprintf(stderr, "       raytrace --generate-clusters <count> output.clusters\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+
+	// the deadline covers loading the scene as well as rendering it
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// READING OPTIONS
+	int progressive = 0;
+	double deadline = 0;
+	int arg = 1;
+	while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+		if (strcmp(argv[arg], "--progressive") == 0) {
+			progressive = 1;
+		} else if (strcmp(argv[arg], "--cache-mb") == 0 && arg + 1 < argc) {
+			arg++;
+			cluster_cache = atoll(argv[arg]) * 1024 * 1024;
+		} else if (strcmp(argv[arg], "--generate-clusters") == 0 && arg + 2 < argc) {
+			// writes a cluster file and exits, no rendering
+			generate_clusters(atoll(argv[arg + 1]), argv[arg + 2]);
+			return 0;
+		} else if (strcmp(argv[arg], "--deadline-ms") == 0 && arg + 1 < argc) {
+			arg++;
+			deadline = atof(argv[arg]);
+			if (deadline <= 0) {
+				fprintf(stderr, "Error: Deadline must be a positive number of milliseconds.\n");
+				exit(1);
+			}
+		} else {
+			fprintf(stderr, "Error: Unknown option \"%s\".\n", argv[arg]);
+			usage();
+		}
+		arg++;
+	}
+	if (argc - arg != 4) {
+		usage();
+	}
+	argv += arg - 1;
+
+	// picture width and height
+	image_width = atoi(argv[1]);
+	image_height = atoi(argv[2]);
+	if (image_width <= 0 || image_height <= 0) {
+		fprintf(stderr, "Error: Image width and height must be positive.\n");
+		exit(1);
+	}
 
 	// READING JSON OBJECTS INTO ARRAY  
 	read_scene(argv[3]);
+	load_meshes();
+	load_clusters();
 	collect_lights();
 	int i = 0;
-	double w;
-	double h;
 	// FINDING CAMERA TO SET WIDTH AND HEIGHT VARIABLES
 	while(1){
+		if (object_array[i] == NULL) {
+			fprintf(stderr, "Error: Scene has no camera.\n");
+			exit(1);
+		}
 		if (object_array[i]->kind == 0){
-			w = object_array[i]->camera.width;
-			h = object_array[i]->camera.height;
+			view_width = object_array[i]->camera.width;
+			view_height = object_array[i]->camera.height;
 			printf("Camera found and variables set.\n");
 			break;
 		}
 		i++;
 	}
-	// camera position
-	double cx = 0;
-	double cy = 0;
 
-	// picture width and height
-	int M = atoi(argv[2]);
-	int N = atoi(argv[1]);
+	image = malloc(image_width * image_height * sizeof(Pixel));
+	bin_objects();
+	reflections = kernels[scene_features()];
 
-	double pixheight = h / M;
-	double pixwidth = w / N;
-	
-	// initializing color vector
-	double color[3] = {0,0,0};
-	
-	// DECREMENTING Y COMPONENT TO FLIP PICTURE 
-	for (int y = M; y > 0; y--) {
-		for (int x = 0; x < N; x += 1) {
-			double Ro[3] = {0, 0, 0};
-			double Rd[3] = {
-				cx - (w/2) + pixwidth * (x + 0.5),
-				cy - (h/2) + pixheight * (y + 0.5),
-				1
-			};
-			normalize(Rd);
-			// first recursive call, which will return a color vector for that pixel
-			reflections(Ro, Rd, Rd, NULL, color, 0);
-			// CREATING A PIXEL
-			Pixel new;
-			// SETTING PIXELS COLOR TO CLOSEST OBJECTS COLOR
-			new.red = color[0];
-			new.green = color[1];
-			new.blue = color[2];
-			// WRITING TO FILE IMMEDIATELY
-			fprintf(output, "%i %i %i ", new.red, new.green, new.blue);
-    	}
-  	}
-  	fclose(output);
+	if (deadline > 0) {
+		render_deadline(argv[4], deadline, &start);
+	} else if (progressive) {
+		render_progressive(argv[4]);
+	} else if (output_format(argv[4]) == FORMAT_PPM) {
+		for (int row = 0; row < image_height; row++) {
+			for (int x = 0; x < image_width; x++) {
+				image[row * image_width + x] = trace_pixel(x, row);
+			}
+		}
+		write_ppm(argv[4]);
+	} else {
+		// compressed formats are encoded a band at a time while the
+		// rows below are still being traced
+		char tmpname[1024];
+		FILE* output = open_output(argv[4], tmpname, sizeof(tmpname));
+		Encoder encoder;
+		start_encoder(&encoder, output_format(argv[4]), image, image_width, image_height);
+		for (int row = 0; row < image_height; row++) {
+			for (int x = 0; x < image_width; x++) {
+				image[row * image_width + x] = trace_pixel(x, row);
+			}
+			rows_finished(&encoder, row + 1);
+		}
+		finish_encoder(&encoder, output);
+		close_output(output, argv[4], tmpname);
+	}
+	free(image);
   	return 0;
 }
@@ -0,0 +1,220 @@
+#!/bin/sh
+# Golden image and throughput regression checks, run by "make check".
+#
+# Every scene in the corpus is rendered and compared with its golden image
+# in tests/golden. A channel may differ by up to TOLERANCE, and at most
+# MAX_BAD pixels per thousand may go past that, since small changes in
+# floating point order can flip pixels along edges.
+#
+# One scene is also written as PNG and as QOI, read back with tests/decode.c
+# and compared with its golden image, so the encoders are checked as well.
+#
+# The scenes in tests/baseline.txt are then rendered at a larger size and
+# their speed in pixels per second is compared with the recorded baseline.
+# A scene fails if it drops below FLOOR percent of its baseline. These
+# renders are written as QOI, which is cheap to encode, so the time goes to
+# tracing rather than to printing a text PPM.
+#
+# "make golden" rewrites the golden images and "make baseline" records new
+# throughput numbers, both from the current build.
+#
+# Run from the top of the repository.
+
+RAYTRACE=./raytrace
+OUT=tests/out
+DECODE=$OUT/decode
+TOLERANCE=${TOLERANCE:-4}
+MAX_BAD=${MAX_BAD:-5}
+FLOOR=${FLOOR:-50}
+SIZE=64
+PERF_SIZE=512
+# best of this many runs is used for throughput
+PERF_RUNS=5
+
+mode=check
+if [ "$1" = "--golden" ]; then
+	mode=golden
+elif [ "$1" = "--baseline" ]; then
+	mode=baseline
+fi
+
+mkdir -p $OUT
+failed=0
+
+# stress_scene() writes a scene of $1 random spheres with a fixed seed, so
+# the scene is the same on every machine
+stress_scene() {
+	awk -v count=$1 'BEGIN {
+		seed = 430
+		print "["
+		print " {\"type\": \"camera\", \"width\": 2.0, \"height\": 2.0},"
+		for (i = 0; i < count; i++) {
+			for (k = 0; k < 7; k++) {
+				seed = (seed * 16807) % 2147483647
+				r[k] = seed / 2147483647
+			}
+			printf " {\"type\": \"sphere\", \"radius\": %.3f, \"reflectivity\": 0, \"refractivity\": 0, \"ior\": 1,", 0.05 + r[0] * 0.1
+			printf " \"diffuse_color\": [%.2f, %.2f, %.2f], \"specular_color\": [1, 1, 1],", r[1], r[2], r[3]
+			printf " \"position\": [%.2f, %.2f, %.2f]},\n", r[4] * 8 - 4, r[5] * 8 - 4, 6 + r[6] * 10
+		}
+		print " {\"type\": \"plane\", \"normal\": [0, 1, 0], \"diffuse_color\": [1, 1, 1], \"specular_color\": [0, 0, 0], \"position\": [0, -4, 0]},"
+		print " {\"type\": \"light\", \"color\": [2, 2, 2], \"theta\": 0, \"radial-a2\": 0.01, \"radial-a1\": 0.01, \"radial-a0\": 0.1, \"position\": [0, 6, 4]}"
+		print "]"
+	}'
+}
+
+stress_scene 2000 > $OUT/stress.json
+$RAYTRACE --generate-clusters 100000 $OUT/stress.clusters > /dev/null || exit 1
+
+# render() renders scene $1 to image $2 with the extra options in $3
+render() {
+	if ! $RAYTRACE $3 $SIZE $SIZE $1 $2 > $OUT/render.log 2>&1; then
+		echo "FAIL $1: renderer failed"
+		cat $OUT/render.log
+		failed=1
+		return 1
+	fi
+}
+
+# compare() checks image $2 against golden image $3, under test name $1
+compare() {
+	result=$(awk -v tolerance=$TOLERANCE -v max_bad=$MAX_BAD '
+		FNR == 1 { file++ }
+		{
+			for (i = 1; i <= NF; i++) {
+				if (file == 1) golden[++g] = $i; else image[++n] = $i
+			}
+		}
+		END {
+			if (g != n || golden[2] != image[2] || golden[3] != image[3]) {
+				print "size differs"
+				exit 1
+			}
+			# header is P3, width, height and depth
+			bad = 0
+			worst = 0
+			for (i = 5; i <= n; i += 3) {
+				over = 0
+				for (c = 0; c < 3; c++) {
+					d = golden[i + c] - image[i + c]
+					if (d < 0) d = -d
+					if (d > worst) worst = d
+					if (d > tolerance) over = 1
+				}
+				bad += over
+			}
+			pixels = (n - 4) / 3
+			if (bad * 1000 > max_bad * pixels) {
+				printf "%d of %d pixels differ, worst channel by %d\n", bad, pixels, worst
+				exit 1
+			}
+			printf "%d of %d pixels over tolerance, worst channel by %d\n", bad, pixels, worst
+		}' $3 $2)
+	if [ $? -ne 0 ]; then
+		echo "FAIL $1: $result"
+		failed=1
+	else
+		echo "ok   $1: $result"
+	fi
+}
+
+# golden_test() renders scene $2 for test $1 and compares it with the
+# golden image named $4, or $1 if not given. With --golden the image is
+# recorded instead, unless it belongs to another test.
+golden_test() {
+	name=$1
+	scene=$2
+	options=$3
+	golden=${4:-$name}
+	if [ $mode = golden ]; then
+		if [ $golden = $name ]; then
+			render $scene tests/golden/$name.ppm "$options" && echo "wrote tests/golden/$name.ppm"
+		fi
+	else
+		render $scene $OUT/$name.ppm "$options" && compare $name $OUT/$name.ppm tests/golden/$golden.ppm
+	fi
+}
+
+# encoded_test() renders scene $2 to a .$3 file under test name $1, decodes
+# it and compares the pixels with golden image $4
+encoded_test() {
+	name=$1
+	if [ $mode = golden ]; then
+		return
+	fi
+	render $2 $OUT/$name.$3 || return
+	if ! $DECODE $OUT/$name.$3 $OUT/$name.ppm > $OUT/render.log 2>&1; then
+		echo "FAIL $name: could not decode $OUT/$name.$3"
+		cat $OUT/render.log
+		failed=1
+		return
+	fi
+	compare $name $OUT/$name.ppm tests/golden/$4.ppm
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# throughput() prints the best pixels per second of a few renders of $1
+throughput() {
+	best=0
+	run=0
+	while [ $run -lt $PERF_RUNS ]; do
+		start=$(now_ns)
+		$RAYTRACE $PERF_SIZE $PERF_SIZE $1 $OUT/perf.qoi > /dev/null 2>&1 || return 1
+		end=$(now_ns)
+		rate=$(( PERF_SIZE * PERF_SIZE * 1000000000 / (end - start + 1) ))
+		if [ $rate -gt $best ]; then
+			best=$rate
+		fi
+		run=$((run + 1))
+	done
+	echo $best
+}
+
+if [ $mode != baseline ]; then
+	golden_test example example.json
+	# the last progressive pass must land on the same image
+	golden_test example-progressive example.json --progressive example
+	golden_test spotlight tests/scenes/spotlight.json
+	golden_test mesh tests/scenes/mesh.json
+	golden_test stress $OUT/stress.json
+	golden_test clusters tests/scenes/clusters.json
+	encoded_test example-png example.json png example
+	encoded_test stress-qoi $OUT/stress.json qoi stress
+fi
+
+if [ $mode = baseline ]; then
+	{
+		echo "# scene  pixels per second at ${PERF_SIZE}x${PERF_SIZE}, recorded by make baseline"
+		for scene in example.json tests/scenes/spotlight.json tests/scenes/mesh.json $OUT/stress.json tests/scenes/clusters.json; do
+			echo "$scene $(throughput $scene)"
+		done
+	} > tests/baseline.txt
+	cat tests/baseline.txt
+elif [ $mode = check ]; then
+	while read scene recorded; do
+		case $scene in
+			\#*|"") continue ;;
+		esac
+		rate=$(throughput $scene)
+		if [ -z "$rate" ]; then
+			echo "FAIL $scene: renderer failed"
+			failed=1
+			continue
+		fi
+		floor=$((recorded * FLOOR / 100))
+		if [ $rate -lt $floor ]; then
+			echo "FAIL $scene: $rate pixels/s, floor is $floor ($FLOOR% of $recorded)"
+			failed=1
+		else
+			echo "ok   $scene: $rate pixels/s, floor is $floor"
+		fi
+	done < tests/baseline.txt
+fi
+
+if [ $failed -ne 0 ]; then
+	echo "check failed"
+	exit 1
+fi
@@ -0,0 +1,353 @@
+// PNG AND QOI DECODER FOR THE TESTS
+//
+// Reads a PNG or QOI file written by the renderer and writes its pixels as a
+// plain text PPM, so tests/check.sh can compare it with a golden image. It
+// shares no code with encode.c, checks every CRC and the zlib checksum, and
+// handles all three deflate block types, so it would notice the encoder
+// writing anything a real decoder would reject.
+//
+// usage: decode input.(png|qoi) output.ppm
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const unsigned char* data;
+  size_t size;
+  size_t pos;
+  unsigned long bits;
+  int count;
+} BitReader;
+
+// HUFFMAN TABLE, CANONICAL CODES GIVEN BY THEIR LENGTHS
+typedef struct {
+  unsigned short counts[16];
+  unsigned short symbols[320];
+} Huffman;
+
+void fail(const char* message) {
+  fprintf(stderr, "decode: %s\n", message);
+  exit(1);
+}
+
+unsigned long be32(const unsigned char* p) {
+  return (unsigned long) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+int get_bits(BitReader* r, int n) {
+  while (r->count < n) {
+    if (r->pos >= r->size) fail("deflate stream ends early");
+    r->bits |= (unsigned long) r->data[r->pos++] << r->count;
+    r->count += 8;
+  }
+  int value = r->bits & ((1UL << n) - 1);
+  r->bits >>= n;
+  r->count -= n;
+  return value;
+}
+
+void build_huffman(Huffman* h, const unsigned char* lengths, int n) {
+  unsigned short offsets[16];
+  memset(h->counts, 0, sizeof(h->counts));
+  for (int i = 0; i < n; i++) h->counts[lengths[i]]++;
+  h->counts[0] = 0;
+  offsets[1] = 0;
+  for (int len = 1; len < 15; len++) offsets[len + 1] = offsets[len] + h->counts[len];
+  for (int i = 0; i < n; i++) {
+    if (lengths[i] != 0) h->symbols[offsets[lengths[i]]++] = i;
+  }
+}
+
+// decode_symbol() reads one code a bit at a time, codes are packed starting
+// from their most significant bit
+int decode_symbol(BitReader* r, Huffman* h) {
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  for (int len = 1; len < 16; len++) {
+    code |= get_bits(r, 1);
+    int count = h->counts[len];
+    if (code - first < count) return h->symbols[index + code - first];
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  fail("bad Huffman code");
+  return 0;
+}
+
+static const short length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const short length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                       3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const short dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                    8193, 12289, 16385, 24577};
+static const short dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                     7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// inflate() decodes a raw deflate stream into out, which must hold exactly
+// size bytes
+void inflate(BitReader* r, unsigned char* out, size_t size) {
+  size_t pos = 0;
+  int last = 0;
+  while (!last) {
+    last = get_bits(r, 1);
+    int type = get_bits(r, 2);
+    if (type == 0) {
+      // stored block, aligned to a byte
+      r->bits = 0;
+      r->count = 0;
+      if (r->pos + 4 > r->size) fail("stored block ends early");
+      int len = r->data[r->pos] | r->data[r->pos + 1] << 8;
+      int nlen = r->data[r->pos + 2] | r->data[r->pos + 3] << 8;
+      if ((len ^ 0xffff) != nlen) fail("bad stored block length");
+      r->pos += 4;
+      if (r->pos + len > r->size || pos + len > size) fail("stored block too long");
+      memcpy(out + pos, r->data + r->pos, len);
+      r->pos += len;
+      pos += len;
+      continue;
+    }
+    Huffman lit;
+    Huffman dist;
+    unsigned char lengths[320];
+    if (type == 1) {
+      for (int i = 0; i < 288; i++) lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+      build_huffman(&lit, lengths, 288);
+      for (int i = 0; i < 30; i++) lengths[i] = 5;
+      build_huffman(&dist, lengths, 30);
+    } else if (type == 2) {
+      static const unsigned char order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+      int nlit = get_bits(r, 5) + 257;
+      int ndist = get_bits(r, 5) + 1;
+      int ncode = get_bits(r, 4) + 4;
+      unsigned char code_lengths[19] = {0};
+      for (int i = 0; i < ncode; i++) code_lengths[order[i]] = get_bits(r, 3);
+      Huffman codes;
+      build_huffman(&codes, code_lengths, 19);
+      int n = 0;
+      while (n < nlit + ndist) {
+        int symbol = decode_symbol(r, &codes);
+        int repeat = 1;
+        int value = symbol;
+        if (symbol == 16) {
+          if (n == 0) fail("repeat with no previous length");
+          value = lengths[n - 1];
+          repeat = 3 + get_bits(r, 2);
+        } else if (symbol == 17) {
+          value = 0;
+          repeat = 3 + get_bits(r, 3);
+        } else if (symbol == 18) {
+          value = 0;
+          repeat = 11 + get_bits(r, 7);
+        }
+        if (n + repeat > nlit + ndist) fail("too many code lengths");
+        while (repeat--) lengths[n++] = value;
+      }
+      build_huffman(&lit, lengths, nlit);
+      build_huffman(&dist, lengths + nlit, ndist);
+    } else {
+      fail("bad deflate block type");
+    }
+    while (1) {
+      int symbol = decode_symbol(r, &lit);
+      if (symbol < 256) {
+        if (pos >= size) fail("too much image data");
+        out[pos++] = symbol;
+      } else if (symbol == 256) {
+        break;
+      } else {
+        symbol -= 257;
+        if (symbol >= 29) fail("bad length code");
+        int len = length_base[symbol] + get_bits(r, length_extra[symbol]);
+        int d = decode_symbol(r, &dist);
+        if (d >= 30) fail("bad distance code");
+        size_t back = dist_base[d] + get_bits(r, dist_extra[d]);
+        if (back > pos) fail("distance before start of data");
+        if (pos + len > size) fail("too much image data");
+        for (int i = 0; i < len; i++, pos++) out[pos] = out[pos - back];
+      }
+    }
+  }
+  if (pos != size) fail("image data is short");
+}
+
+unsigned long crc32(const unsigned char* data, size_t size) {
+  unsigned long crc = 0xffffffff;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (int k = 0; k < 8; k++) crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+  }
+  return crc ^ 0xffffffff;
+}
+
+unsigned long adler32(const unsigned char* data, size_t size) {
+  unsigned long a = 1;
+  unsigned long b = 0;
+  for (size_t i = 0; i < size; i++) {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return b << 16 | a;
+}
+
+int paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  if (pb <= pc) return b;
+  return c;
+}
+
+unsigned char* decode_png(const unsigned char* file, size_t size, int* width, int* height) {
+  static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  if (size < 8 || memcmp(file, signature, 8) != 0) fail("not a PNG file");
+  unsigned char* idat = NULL;
+  size_t idat_size = 0;
+  int ended = 0;
+  size_t pos = 8;
+  while (!ended) {
+    if (pos + 12 > size) fail("PNG chunk runs past the end of the file");
+    size_t len = be32(file + pos);
+    const unsigned char* type = file + pos + 4;
+    if (pos + 12 + len > size) fail("PNG chunk runs past the end of the file");
+    if (crc32(type, len + 4) != be32(type + 4 + len)) fail("bad PNG chunk CRC");
+    const unsigned char* body = type + 4;
+    if (memcmp(type, "IHDR", 4) == 0) {
+      if (len != 13) fail("bad IHDR");
+      *width = be32(body);
+      *height = be32(body + 4);
+      if (body[8] != 8 || body[9] != 2 || body[12] != 0) fail("only 8 bit RGB without interlacing is supported");
+    } else if (memcmp(type, "IDAT", 4) == 0) {
+      idat = realloc(idat, idat_size + len);
+      memcpy(idat + idat_size, body, len);
+      idat_size += len;
+    } else if (memcmp(type, "IEND", 4) == 0) {
+      ended = 1;
+    }
+    pos += 12 + len;
+  }
+  if (idat_size < 6 || (idat[0] & 0x0f) != 8 || (idat[0] << 8 | idat[1]) % 31 != 0) fail("bad zlib header");
+  size_t stride = (size_t) *width * 3;
+  size_t raw_size = (stride + 1) * *height;
+  unsigned char* raw = malloc(raw_size);
+  BitReader r = {idat + 2, idat_size - 6, 0, 0, 0};
+  inflate(&r, raw, raw_size);
+  if (adler32(raw, raw_size) != be32(idat + idat_size - 4)) fail("bad zlib checksum");
+
+  unsigned char* pixels = malloc(stride * *height);
+  for (int y = 0; y < *height; y++) {
+    int filter = raw[y * (stride + 1)];
+    const unsigned char* in = raw + y * (stride + 1) + 1;
+    unsigned char* row = pixels + y * stride;
+    const unsigned char* up = y > 0 ? row - stride : NULL;
+    for (size_t i = 0; i < stride; i++) {
+      int a = i >= 3 ? row[i - 3] : 0;
+      int b = up != NULL ? up[i] : 0;
+      int c = i >= 3 && up != NULL ? up[i - 3] : 0;
+      int p;
+      switch (filter) {
+        case 0: p = 0; break;
+        case 1: p = a; break;
+        case 2: p = b; break;
+        case 3: p = (a + b) / 2; break;
+        case 4: p = paeth(a, b, c); break;
+        default: fail("bad PNG filter type");
+      }
+      row[i] = in[i] + p;
+    }
+  }
+  free(raw);
+  free(idat);
+  return pixels;
+}
+
+unsigned char* decode_qoi(const unsigned char* file, size_t size, int* width, int* height) {
+  static const unsigned char end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  if (size < 22 || memcmp(file, "qoif", 4) != 0) fail("not a QOI file");
+  *width = be32(file + 4);
+  *height = be32(file + 8);
+  if (file[12] != 3) fail("only RGB QOI files are supported");
+  if (memcmp(file + size - 8, end_marker, 8) != 0) fail("missing QOI end marker");
+  size_t count = (size_t) *width * *height;
+  unsigned char* pixels = malloc(count * 3);
+  unsigned char index[64][4];
+  memset(index, 0, sizeof(index));
+  unsigned char px[4] = {0, 0, 0, 255};
+  size_t pos = 14;
+  size_t end = size - 8;
+  int run = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (run > 0) {
+      run--;
+    } else {
+      if (pos >= end) fail("QOI data ends early");
+      int op = file[pos++];
+      if (op == 0xfe) {
+        if (pos + 3 > end) fail("QOI data ends early");
+        memcpy(px, file + pos, 3);
+        pos += 3;
+      } else if (op == 0xff) {
+        if (pos + 4 > end) fail("QOI data ends early");
+        memcpy(px, file + pos, 4);
+        pos += 4;
+      } else if ((op & 0xc0) == 0x00) {
+        memcpy(px, index[op], 4);
+      } else if ((op & 0xc0) == 0x40) {
+        px[0] += ((op >> 4) & 3) - 2;
+        px[1] += ((op >> 2) & 3) - 2;
+        px[2] += (op & 3) - 2;
+      } else if ((op & 0xc0) == 0x80) {
+        if (pos >= end) fail("QOI data ends early");
+        int second = file[pos++];
+        int vg = (op & 0x3f) - 32;
+        px[0] += vg - 8 + ((second >> 4) & 0x0f);
+        px[1] += vg;
+        px[2] += vg - 8 + (second & 0x0f);
+      } else {
+        run = op & 0x3f;
+      }
+      memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+    }
+    memcpy(pixels + i * 3, px, 3);
+  }
+  if (run > 0 || pos != end) fail("QOI data does not match the image size");
+  return pixels;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: decode input.(png|qoi) output.ppm\n");
+    return 1;
+  }
+  FILE* input = fopen(argv[1], "rb");
+  if (input == NULL) fail("could not open input");
+  fseek(input, 0, SEEK_END);
+  size_t size = ftell(input);
+  fseek(input, 0, SEEK_SET);
+  unsigned char* file = malloc(size);
+  if (fread(file, 1, size, input) != size) fail("could not read input");
+  fclose(input);
+
+  int width;
+  int height;
+  unsigned char* pixels;
+  if (size >= 4 && memcmp(file, "qoif", 4) == 0) {
+    pixels = decode_qoi(file, size, &width, &height);
+  } else {
+    pixels = decode_png(file, size, &width, &height);
+  }
+
+  FILE* output = fopen(argv[2], "w");
+  if (output == NULL) fail("could not open output");
+  fprintf(output, "P3\n%d %d\n255\n", width, height);
+  for (size_t i = 0; i < (size_t) width * height; i++) {
+    fprintf(output, "%d %d %d ", pixels[i*3], pixels[i*3 + 1], pixels[i*3 + 2]);
+  }
+  fclose(output);
+  return 0;
+}